@@ -0,0 +1,270 @@
+/*
+ * Benchmark of the package table against the std::map it replaced, on a
+ * generated install config shaped like a Debian source.
+ *
+ * bench-packages [-n <sections>] [-r <runs>]
+ */
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "vpkg/config.hh"
+#include "vpkg/index.hh"
+
+static const char *prefixes[] = {"lib", "lib", "lib", "python3-", "golang-", "node-", "r-cran-", "fonts-", ""};
+static const char *words[] = {"gtk", "qt", "xml", "ssl", "boost", "perl", "ruby", "gnome", "kde", "sdl",
+                              "curl", "dbus", "glib", "llvm", "mesa", "pulse", "x11", "ocaml", "haskell", "java"};
+
+static uint64_t rng = 0x9e3779b97f4a7c15;
+
+static uint64_t next()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+/*
+ * Bytes requested by the std::map, plus the malloc header of each node.
+ */
+static size_t map_bytes = 0;
+
+template<typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    counting_allocator() = default;
+    template<typename U>
+    counting_allocator(const counting_allocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        map_bytes += n * sizeof(T) + 16;
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        map_bytes -= n * sizeof(T) + 16;
+        ::operator delete(p);
+    }
+
+    bool operator==(const counting_allocator &) const { return true; }
+};
+
+using package_map = std::map<std::string_view, vpkg::package, std::less<>, counting_allocator<std::pair<const std::string_view, vpkg::package>>>;
+
+static int write_config(const char *path, size_t n)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        const char *prefix = prefixes[next() % (sizeof(prefixes) / sizeof(*prefixes))];
+        const char *word = words[next() % (sizeof(words) / sizeof(*words))];
+        unsigned major = next() % 20, minor = next() % 100;
+
+        fprintf(f, "[%s%s%zu-%u.%u.%u]\n", prefix, word, i, major, minor, (unsigned)(next() % 10));
+        fprintf(f, "url = https://deb.debian.org/debian/pool/main/%c/%s%zu/%s%zu_%u.%u_amd64.deb\n", word[0], word, i, word, i, major, minor);
+        fprintf(f, "deps = libc6>=2.36 lib%s%zu>=0\n", word, (size_t)(next() % n));
+        fprintf(f, "sha256 = %016llx%016llx%016llx%016llx\n", (unsigned long long)next(), (unsigned long long)next(),
+                (unsigned long long)next(), (unsigned long long)next());
+        fprintf(f, "size = %llu\n\n", (unsigned long long)(next() % (64 << 20)));
+    }
+
+    return fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<double> cold, warm, table_build, map_build, table_1k, map_1k, table_1m, map_1m;
+    std::vector<std::string_view> names;
+    std::vector<std::string_view> sample;
+    std::vector<std::string_view> order;
+    std::vector<vpkg::packages::value_type> entries;
+    std::vector<uint64_t> hashes;
+    size_t table_mem = 0, table_mem_warm = 0;
+    size_t n = 100000;
+    int runs = 7;
+    size_t hits = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: bench-packages [-n <sections>] [-r <runs>]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    char dir[] = "/tmp/vpkg-bench.XXXXXX";
+    if (mkdtemp(dir) == NULL || n == 0 || runs < 1) {
+        perror("bench-packages");
+        return EXIT_FAILURE;
+    }
+
+    std::string ini = std::string{dir} + "/bench.ini";
+    std::string idx = ini + VPKG_INDEX_SUFFIX;
+
+    if (write_config(ini.c_str(), n) != 0) {
+        perror("failed to write config");
+        return EXIT_FAILURE;
+    }
+
+    for (int r = 0; r < runs; r++) {
+        vpkg::config config;
+        double t;
+
+        unlink(idx.c_str());
+
+        t = now();
+        if (vpkg::config_init(&config, ini.c_str()) != 0) {
+            perror("config_init");
+            return EXIT_FAILURE;
+        }
+
+        cold.push_back(now() - t);
+        table_mem = config.packages.arena().size();
+        vpkg::config_fini(&config);
+    }
+
+    for (int r = 0; r < runs; r++) {
+        vpkg::config config;
+        double t;
+
+        t = now();
+        if (vpkg::config_init(&config, ini.c_str()) != 0 || config.index == nullptr) {
+            perror("config_init");
+            return EXIT_FAILURE;
+        }
+
+        warm.push_back(now() - t);
+        table_mem_warm = config.packages.arena().size();
+
+        names.clear();
+        for (auto &it : config.packages) {
+            names.push_back(it.first);
+        }
+
+        // One lookup per installed package, as vpkg-install -u does.
+        sample.clear();
+        for (size_t i = 0; i < 1000; i++) {
+            sample.push_back(names[next() % names.size()]);
+        }
+
+        // Sorted order would favour the map, look names up at random.
+        order.clear();
+        for (size_t i = 0; i < 1000000; i++) {
+            order.push_back(names[next() % names.size()]);
+        }
+
+        entries.clear();
+        hashes.clear();
+        for (auto &it : config.packages) {
+            entries.push_back(it);
+            hashes.push_back(vpkg::packages_hash(it.first));
+        }
+
+        // Both built like they are from the index: the table from the stored
+        // hashes, the map appended to in sorted order.
+        vpkg::packages table;
+        t = now();
+        if (table.assign(entries.size(), [&](size_t i) { return hashes[i]; }, [&](size_t i) { return entries[i]; }) != 0) {
+            perror("assign");
+            return EXIT_FAILURE;
+        }
+
+        table_build.push_back(now() - t);
+
+        package_map map;
+        map_bytes = 0;
+        t = now();
+        for (auto &it : config.packages) {
+            map.emplace_hint(map.end(), it.first, it.second);
+        }
+
+        map_build.push_back(now() - t);
+
+        t = now();
+        for (std::string_view name : sample) {
+            hits += table.find(name) != table.end();
+        }
+
+        table_1k.push_back((now() - t) * 1e3);
+
+        t = now();
+        for (std::string_view name : sample) {
+            hits += map.find(name) != map.end();
+        }
+
+        map_1k.push_back((now() - t) * 1e3);
+
+        t = now();
+        for (std::string_view name : order) {
+            hits += table.find(name) != table.end();
+        }
+
+        table_1m.push_back(now() - t);
+
+        t = now();
+        for (std::string_view name : order) {
+            hits += map.find(name) != map.end();
+        }
+
+        map_1m.push_back(now() - t);
+
+        if (r == runs - 1) {
+            printf("%zu sections, median of %d runs, %zu hits\n\n", config.packages.size(), runs, hits);
+            printf("config_init without index  %9.2f ms (min %.2f)\n", median(cold), *std::min_element(cold.begin(), cold.end()));
+            printf("config_init from index     %9.2f ms (min %.2f)\n", median(warm), *std::min_element(warm.begin(), warm.end()));
+            printf("table memory, parsed       %9.2f MiB\n", table_mem / 1048576.0);
+            printf("table memory, from index   %9.2f MiB\n\n", table_mem_warm / 1048576.0);
+            printf("%-12s %12s %12s %12s %12s\n", "", "build ms", "1k find us", "1M find ms", "memory MiB");
+            printf("%-12s %12.2f %12.1f %12.2f %12.2f\n", "packages", median(table_build), median(table_1k), median(table_1m),
+                   table.arena().size() / 1048576.0);
+            printf("%-12s %12.2f %12.1f %12.2f %12.2f\n", "std::map", median(map_build), median(map_1k), median(map_1m),
+                   map_bytes / 1048576.0);
+        }
+
+        vpkg::config_fini(&config);
+    }
+
+    unlink(idx.c_str());
+    unlink(ini.c_str());
+    rmdir(dir);
+
+    return EXIT_SUCCESS;
+}
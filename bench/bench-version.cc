@@ -0,0 +1,164 @@
+/*
+ * Check of vpkg::version_key_cmp and vpkg::version_cmp against xbps_cmpver on
+ * every ordered pair of a list of real Debian versions, and a benchmark of
+ * the ways vpkg-install -u compares versions.
+ *
+ * bench-version [<versions>]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "vpkg/version.hh"
+
+extern "C" int dewey_cmpver(const char *pkg1, const char *pkg2);
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Debian versions as xdeb registers them.
+ */
+static std::string to_xbps(std::string version)
+{
+    for (char &c : version) {
+        if (c == '-' || c == '_' || c == '/') {
+            c = '.';
+        }
+    }
+
+    return version;
+}
+
+struct version {
+    // As in the install config, as converted and as installed, with revision.
+    std::string deb, xbps, installed;
+    int32_t deb_buf[VERSION_KEY_MAX], xbps_buf[VERSION_KEY_MAX], installed_buf[VERSION_KEY_MAX];
+    vpkg::version_key deb_key, xbps_key, installed_key;
+};
+
+static std::vector<version> versions;
+static volatile int sink;
+
+template<typename Compare>
+static void bench(const char *what, Compare &&compare)
+{
+    size_t n = 0;
+    double t = now();
+
+    // Every 7th available version, to keep the run short.
+    for (size_t i = 0; i < versions.size(); i++) {
+        for (size_t j = 0; j < versions.size(); j += 7, n++) {
+            sink = sink + compare(&versions[i], &versions[j]);
+        }
+    }
+
+    printf("%-40s %8.1f ns/compare\n", what, (now() - t) / n);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "bench/debian-versions.txt";
+    size_t pairs = 0, bad_xbps = 0, bad_deb = 0, bad_installed = 0, bad_cmp = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path, "re");
+    if (f == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    while ((len = getline(&line, &size, f)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if (len == 0) {
+            continue;
+        }
+
+        versions.emplace_back();
+        versions.back().deb = line;
+    }
+
+    free(line);
+    fclose(f);
+
+    for (size_t i = 0; i < versions.size(); i++) {
+        version *v = &versions[i];
+
+        v->xbps = to_xbps(v->deb);
+        v->installed = v->xbps + "_" + std::to_string(1 + i % 3);
+
+        if (vpkg::version_key_init(&v->deb_key, v->deb_buf, VERSION_KEY_MAX, v->deb, true) != 0 ||
+            vpkg::version_key_init(&v->xbps_key, v->xbps_buf, VERSION_KEY_MAX, v->xbps, false) != 0 ||
+            vpkg::version_key_init(&v->installed_key, v->installed_buf, VERSION_KEY_MAX, v->installed, false) != 0) {
+            fprintf(stderr, "version too long: %s\n", v->deb.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (const version &a : versions) {
+        for (const version &b : versions) {
+            int want = dewey_cmpver(a.xbps.c_str(), b.xbps.c_str());
+            int want_installed = dewey_cmpver(a.installed.c_str(), b.xbps.c_str());
+
+            pairs++;
+
+            if (vpkg::version_key_cmp(&a.xbps_key, &b.xbps_key) != want && bad_xbps++ < 5) {
+                fprintf(stderr, "key mismatch: %s %s\n", a.xbps.c_str(), b.xbps.c_str());
+            }
+
+            if (vpkg::version_key_cmp(&a.deb_key, &b.deb_key) != want && bad_deb++ < 5) {
+                fprintf(stderr, "normalized key mismatch: %s %s\n", a.deb.c_str(), b.deb.c_str());
+            }
+
+            if (vpkg::version_key_cmp(&a.installed_key, &b.xbps_key) != want_installed && bad_installed++ < 5) {
+                fprintf(stderr, "installed key mismatch: %s %s\n", a.installed.c_str(), b.xbps.c_str());
+            }
+
+            if (vpkg::version_cmp(a.xbps, b.xbps) != want && bad_cmp++ < 5) {
+                fprintf(stderr, "version_cmp mismatch: %s %s\n", a.xbps.c_str(), b.xbps.c_str());
+            }
+        }
+    }
+
+    printf("%zu versions, %zu ordered pairs\n", versions.size(), pairs);
+    printf("mismatches: key %zu, normalized key %zu, installed key %zu, version_cmp %zu\n\n", bad_xbps, bad_deb,
+           bad_installed, bad_cmp);
+
+    bench("xbps_cmpver(installed, available)", [](const version *a, const version *b) {
+        return dewey_cmpver(a->installed.c_str(), b->xbps.c_str());
+    });
+
+    bench("version_cmp(installed, available)", [](const version *a, const version *b) {
+        return vpkg::version_cmp(a->installed, b->xbps);
+    });
+
+    // The installed version is split per compare, the available one comes
+    // precomputed from the index.
+    bench("version_key_init + version_key_cmp", [](const version *a, const version *b) {
+        int32_t buf[VERSION_KEY_MAX];
+        vpkg::version_key key;
+
+        vpkg::version_key_init(&key, buf, VERSION_KEY_MAX, a->installed, false);
+        return vpkg::version_key_cmp(&key, &b->deb_key);
+    });
+
+    bench("version_key_cmp, both precomputed", [](const version *a, const version *b) {
+        return vpkg::version_key_cmp(&a->installed_key, &b->deb_key);
+    });
+
+    return bad_xbps || bad_deb || bad_installed || bad_cmp ? EXIT_FAILURE : EXIT_SUCCESS;
+}
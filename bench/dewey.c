@@ -0,0 +1,168 @@
+/*	$NetBSD: dewey.c,v 1.11 2009/03/06 15:18:42 joerg Exp $	*/
+
+/*
+ * Copyright (c) 2002 Alistair G. Crooks.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The version comparison of xbps lib/dewey.c, only used by bench-version to
+ * check vpkg::version_key_cmp against it. xbps_cmpver is renamed, so it does
+ * not clash with the one of libxbps.
+ */
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+enum { DEWEY_LT, DEWEY_LE, DEWEY_EQ, DEWEY_GE, DEWEY_GT, DEWEY_NE };
+enum { Alpha = -3, Beta = -2, RC = -1, Dot = 0, Patch = 1 };
+typedef struct arr_t { unsigned c; unsigned size; int *v; int revision; } arr_t;
+typedef struct test_t { const char *s; unsigned len; int t; } test_t;
+static const test_t modifiers[] = {
+	{ "alpha", 5, Alpha }, { "beta", 4, Beta }, { "pre", 3, RC }, { "rc", 2, RC },
+	{ "pl", 2, Dot }, { ".", 1, Dot }, { NULL, 0, 0 }
+};
+static int
+mkcomponent(arr_t *ap, const char *num)
+{
+	static const char alphas[] = "abcdefghijklmnopqrstuvwxyz";
+	const test_t *modp;
+	int n;
+	const char *cp;
+
+	if (ap->c == ap->size) {
+		if (ap->size == 0) {
+			ap->size = 62;
+			if ((ap->v = malloc(ap->size * sizeof(int))) == NULL)
+				return 0;
+		} else {
+			ap->size *= 2;
+			ap->v = realloc(ap->v, ap->size * sizeof(int));
+			assert(ap->v != NULL);
+		}
+	}
+	if (isdigit((unsigned char)*num)) {
+		for (cp = num, n = 0; isdigit((unsigned char)*num); num++) {
+			n = (n * 10) + (*num - '0');
+		}
+		ap->v[ap->c++] = n;
+		return (int)(num - cp);
+	}
+	for (modp = modifiers; modp->s; modp++) {
+		if (strncasecmp(num, modp->s, modp->len) == 0) {
+			ap->v[ap->c++] = modp->t;
+			return modp->len;
+		}
+	}
+	if (strncasecmp(num, "_", 1) == 0) {
+		for (cp = num, num += 1, n = 0; isdigit((unsigned char)*num); num++) {
+			n = (n * 10) + (*num - '0');
+		}
+		ap->revision = n;
+		return (int)(num - cp);
+	}
+	if (isalpha((unsigned char)*num)) {
+		ap->v[ap->c++] = Dot;
+		cp = strchr(alphas, tolower((unsigned char)*num));
+		if (ap->c == ap->size) {
+			ap->size *= 2;
+			if ((ap->v = realloc(ap->v, ap->size * sizeof(int))) == NULL)
+				return 0;
+		}
+		if (cp)
+			ap->v[ap->c++] = (int)(cp - alphas) + 1;
+		return 1;
+	}
+	return 1;
+}
+static int
+mkversion(arr_t *ap, const char *num)
+{
+	ap->c = 0;
+	ap->size = 0;
+	ap->v = NULL;
+	ap->revision = 0;
+	while (*num) {
+		num += mkcomponent(ap, num);
+	}
+	return 1;
+}
+static void
+freeversion(arr_t *ap)
+{
+	free(ap->v);
+	ap->v = NULL;
+	ap->c = 0;
+	ap->size = 0;
+}
+#define DIGIT(v, c, n) (((n) < (c)) ? v[n] : 0)
+static int
+result(int cmp, int tst)
+{
+	switch (tst) {
+	case DEWEY_LT: return cmp < 0;
+	case DEWEY_LE: return cmp <= 0;
+	case DEWEY_GT: return cmp > 0;
+	case DEWEY_GE: return cmp >= 0;
+	case DEWEY_EQ: return cmp == 0;
+	case DEWEY_NE: return cmp != 0;
+	default: return 0;
+	}
+}
+static int
+vtest(arr_t *lhs, int tst, arr_t *rhs)
+{
+	int cmp;
+	unsigned int c, i;
+
+	for (i = 0, c = MAX(lhs->c, rhs->c); i < c; i++) {
+		if ((cmp = DIGIT(lhs->v, lhs->c, i) - DIGIT(rhs->v, rhs->c, i)) != 0) {
+			return result(cmp, tst);
+		}
+	}
+	return result(lhs->revision - rhs->revision, tst);
+}
+int
+dewey_cmpver(const char *pkg1, const char *pkg2)
+{
+	int res;
+	arr_t v1, v2;
+
+	mkversion(&v1, pkg1);
+	mkversion(&v2, pkg2);
+	if (vtest(&v1, DEWEY_LT, &v2)) {
+		res = -1;
+	} else if (vtest(&v1, DEWEY_GT, &v2)) {
+		res = 1;
+	} else {
+		res = 0;
+	}
+	freeversion(&v1);
+	freeversion(&v2);
+	return res;
+}
@@ -1,6 +1,8 @@
 VPKG_REVISION = $(shell git rev-parse --short HEAD)
-VPKG_INSTALL_CONFIG_PATH = /etc/vpkg-install.ini
+VPKG_INSTALL_CONFIG_PATH = /etc/vpkg-install.d
+VPKG_LEGACY_INSTALL_CONFIG_PATH = /etc/vpkg-install.ini
 VPKG_SYNC_CONFIG_PATH = /etc/vpkg-sync.toml
 VPKG_TEMPDIR_PATH = /tmp/vpkg
 VPKG_BINPKGS_PATH = /var/lib/vpkg
 VPKG_XDEB_SHLIBS_PATH = /var/lib/vpkg/shlibs
+VPKG_DEBCACHE_MAX_MIB = 4096
@@ -198,7 +198,7 @@ repodata_commit(const char *repodir, const char *repoarch,
 
 int
 index_add_pkg(struct xbps_handle *xhp, xbps_dictionary_t index, xbps_dictionary_t stage,
-		const char *file, bool force)
+		const char *file, const char *filename_sha256, bool force)
 {
 	char sha256[XBPS_SHA256_SIZE];
 	char pkgname[XBPS_NAME_SIZE];
@@ -265,9 +265,16 @@ index_add_pkg(struct xbps_handle *xhp, xbps_dictionary_t index, xbps_dictionary_
 		}
 	}
 
-	if (!xbps_file_sha256(sha256, sizeof(sha256), file))
-		goto err_errno;
-	if (!xbps_dictionary_set_cstring(binpkgd, "filename-sha256", sha256))
+	/*
+	 * Callers that already hashed the package pass its hash, so it is
+	 * not read again.
+	 */
+	if (filename_sha256 == NULL) {
+		if (!xbps_file_sha256(sha256, sizeof(sha256), file))
+			goto err_errno;
+		filename_sha256 = sha256;
+	}
+	if (!xbps_dictionary_set_cstring(binpkgd, "filename-sha256", filename_sha256))
 		goto err_errno;
 	if (stat(file, &st) == -1)
 		goto err_errno;
@@ -333,7 +340,7 @@ index_add(struct xbps_handle *xhp, int args, int argc, char **argv, bool force,
 	}
 
 	for (int i = args; i < argc; i++) {
-		r = index_add_pkg(xhp, index, stage, argv[i], force);
+		r = index_add_pkg(xhp, index, stage, argv[i], NULL, force);
 		if (r < 0)
 			goto err2;
 	}
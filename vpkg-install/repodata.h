@@ -33,6 +33,7 @@ index_add_pkg(
     xbps_dictionary_t index,
     xbps_dictionary_t stage,
     const char *file,
+    const char *filename_sha256,
     bool force);
 
 #ifdef __cplusplus
@@ -29,17 +29,44 @@
 #include "vpkg-install/repodata.h"
 
 #include "vpkg/config.hh"
+#include "vpkg/convert.hh"
+#include "vpkg/debcache.hh"
+#include "vpkg/debstream.hh"
+#include "vpkg/download.hh"
+#include "vpkg/hash.hh"
+#include "vpkg/mirrors.hh"
+#include "vpkg/installed.hh"
 #include "vpkg/util.hh"
 
 #include <atomic>
 #include <vector>
 
+// Where the control files and the contents of a deb are extracted to in the
+// pkgroot, the directories xdeb uses.
+#define PKGROOT_DATADIR "data"
+#define PKGROOT_DESTDIR "destdir"
+
 static void usage(int code)
 {
-    fprintf(stderr, "usage: vpkg-install [-vfRuS] [-c <config_path>]\n");
+    fprintf(stderr, "usage: vpkg-install [-vfCRuSx] [-c <config_path>] [-d <downloads>] [-j <conversions>]\n");
     exit(code);
 }
 
+static unsigned long parse_jobs(const char *arg)
+{
+    unsigned long jobs;
+    char *end;
+
+    errno = 0;
+    jobs = strtoul(arg, &end, 10);
+
+    if (errno != 0 || *arg == '\0' || *end != '\0' || jobs == 0 || jobs > 1024) {
+        usage(EXIT_FAILURE);
+    }
+
+    return jobs;
+}
+
 static char *read_all_null_no_tr_nl(int fd, size_t *length)
 {
     char *buf = NULL;
@@ -83,6 +110,7 @@ struct vpkg_progress {
     enum state {
         INIT,
         CURL,
+        QUEUED,
         XDEB,
         DONE,
         ERROR,
@@ -102,37 +130,50 @@ struct vpkg_progress {
     char *error_message;
 };
 
-struct vpkg_check_update_cb_data {
-    vpkg::packages *packages;
-
-    sem_t *sem_data;
-    bool force;
-
-    std::vector<::vpkg::packages::iterator> *packages_to_update;
-};
-
 struct vpkg_do_update_thread_shared_data {
     std::vector<::vpkg::packages::iterator> *packages_to_update;
     struct tqueue progress_queue;
     struct xbps_handle *xhp;
     struct xbps_repo *repo;
+    vpkg::downloader downloader;
+    vpkg::debcache debcache;
+    vpkg::mirrors *mirrors;
 
     vpkg::packages *packages;
+    vpkg::installed *installed;
     std::atomic<unsigned long> next_package;
     std::atomic<unsigned long> packages_done;
 
+    // Downloaded packages waiting for conversion, bounded by sem_convert_limit.
+    struct tqueue convert_queue;
+    std::atomic<unsigned long> convert_queued;
+
+    // Unused entries of the thread data, protected by sem_data.
+    std::vector<struct vpkg_do_update_thread_data *> free_slots;
+
     std::vector<xbps_dictionary_t> install_xbps;
     bool force;
 
+    // Convert in process instead of with xdeb, compressing with
+    // convert_threads threads each.
+    bool native;
+    int convert_threads;
+    vpkg::shlibs shlibs;
+
     size_t manual_size;
 
     sem_t sem_data;
     sem_t sem_prod_cons;
     sem_t sem_progress_limit;
+    sem_t sem_convert_limit;
 
     xbps_dictionary_t idx, idxmeta, idxstage;
 };
 
+/*
+ * A package in flight. It is handed from the download to the conversion
+ * stage, tid_local identifies its line in the progress display.
+ */
 struct vpkg_do_update_thread_data {
     struct vpkg_do_update_thread_shared_data *shared;
 
@@ -140,34 +181,16 @@ struct vpkg_do_update_thread_data {
     int tid_local;
 
     ::vpkg::packages::iterator current;
-};
-
-static int vpkg_check_update_cb(struct xbps_handle *xhp, xbps_object_t obj, const char *pkgname, void *user_, bool *)
-{
-    xbps_dictionary_t xpkg = static_cast<xbps_dictionary_t>(obj);
-    vpkg_check_update_cb_data *user = static_cast<vpkg_check_update_cb_data *>(user_);
-
-    assert(xbps_object_type(obj) == XBPS_TYPE_DICTIONARY);
-
-    if (!is_xdeb(xpkg)) {
-        return 0;
-    }
-
-    auto it = user->packages->find(pkgname);
-    if (it == user->packages->end()) {
-        return 0;
-    }
-
-    if (!user->force && xbps_vpkg_gtver(xpkg, &it->second) != 1) {
-        return 0;
-    }
+    char *deb_package_path;
 
-    RETRY_EINTR(sem_wait(user->sem_data));
-    user->packages_to_update->push_back(it);
-    ASSERT_NOERR(sem_post(user->sem_data));
+    // Download in progress, set while the downloader calls progressfn.
+    ::vpkg::partial *partial;
 
-    return 0;
-}
+    // Extraction of the deb into the pkgroot while it is downloaded, to be
+    // waited for before converting it if extracting is set.
+    ::vpkg::debstream stream;
+    bool extracting;
+};
 
 static int post_state(struct vpkg_do_update_thread_data *self, enum vpkg_progress::state state)
 {
@@ -230,9 +253,10 @@ static int progressfn(void *self_, curl_off_t dltotal, curl_off_t dlnow, curl_of
     data->current_offset = self->current_offset;
     data->tid_local = self->tid_local;
 
+    // A resumed download only reports the missing bytes.
     data->state = vpkg_progress::CURL;
-    data->dltotal = dltotal;
-    data->dlnow = dlnow;
+    data->dltotal = dltotal > 0 ? dltotal + self->partial->start : 0;
+    data->dlnow = dlnow + self->partial->start;
     data->ultotal = ultotal;
     data->ulnow = ulnow;
 
@@ -241,296 +265,658 @@ static int progressfn(void *self_, curl_off_t dltotal, curl_off_t dlnow, curl_of
     return 0;
 }
 
-static CURLcode download(const char *url, FILE *file, vpkg_do_update_thread_data *arg)
+/*
+ * Create the scratch directory of xdeb for the slot of arg.
+ */
+static int make_pkgroot(const vpkg_do_update_thread_data *arg, char *pkgroot, size_t size)
 {
-    CURLcode code = CURLE_OK;
+    snprintf(pkgroot, size, "%s/%d", VPKG_TEMPDIR, arg->tid_local);
 
-    CURL *curl = curl_easy_init();
-    if (curl == NULL) {
-        return CURLE_FAILED_INIT;
+    if (mkdir(pkgroot, 0644) < 0 && errno != EEXIST) {
+        return -1;
     }
 
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_URL, url) : code;
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) : code;
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progressfn) : code;
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_XFERINFODATA, arg) : code;
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L) : code;
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_USERAGENT, "curl/8.8.0") : code;
-    code = (code == CURLE_OK) ? curl_easy_setopt(curl, CURLOPT_WRITEDATA, file) : code;
-    code = (code == CURLE_OK) ? curl_easy_perform(curl) : code;
-    curl_easy_cleanup(curl);
+    return 0;
+}
+
+/*
+ * Follow the download of the deb at path and extract it into the pkgroot
+ * of arg, where xdeb -b expects it.
+ */
+static void start_extracting(vpkg::partial *partial, const char *path, vpkg_do_update_thread_data *arg)
+{
+    char pkgroot[sizeof(VPKG_TEMPDIR) + 16];
 
-    return code;
+    // Without it xdeb extracts the deb itself once it is downloaded.
+    if (make_pkgroot(arg, pkgroot, sizeof(pkgroot)) != 0) {
+        return;
+    }
+
+    std::string datadir = std::string{pkgroot} + "/" PKGROOT_DATADIR;
+    std::string destdir = std::string{pkgroot} + "/" PKGROOT_DESTDIR;
+
+    if (vpkg::debstream_start(&arg->stream, path, partial->offset, datadir.c_str(), destdir.c_str()) != 0) {
+        return;
+    }
+
+    partial->written = vpkg::debstream_advance;
+    partial->written_user = &arg->stream;
+    arg->extracting = true;
 }
 
-static void *vpkg_do_update_thread(void *arg_)
+/*
+ * Wait for the extraction of arg to finish.
+ *
+ * @return true if the deb was fully extracted.
+ */
+static bool stop_extracting(vpkg_do_update_thread_data *arg)
 {
-    vpkg_do_update_thread_data *arg = static_cast<vpkg_do_update_thread_data *>(arg_);
+    if (!arg->extracting) {
+        return false;
+    }
+
+    arg->extracting = false;
+    return vpkg::debstream_wait(&arg->stream) == 0;
+}
+
+/*
+ * Download url to path, continuing where an earlier attempt was interrupted,
+ * and check it against the size and sha256 of pkg if its source published
+ * them. The partial file is kept if the download fails, unless it turned out
+ * to be another file.
+ *
+ * @return nonzero after posting an error.
+ */
+static int download(const char *url, const char *path, const vpkg::package *pkg, vpkg_do_update_thread_data *arg)
+{
+    CURLcode code = CURLE_OK;
+    vpkg::transfer transfer;
+    vpkg::partial partial;
+    size_t mirror = 0;
+    int eno = 0;
+    long status;
+
+    if (vpkg::partial_open(&partial, path, url) != 0) {
+        post_error(arg, "failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (vpkg::partial_expect(&partial, pkg->sha256, pkg->size ? (curl_off_t)pkg->size : -1) != 0) {
+        post_error(arg, "failed to hash %s: %s", path, strerror(errno));
+        vpkg::partial_close(&partial, false);
+        return -1;
+    }
+
+    start_extracting(&partial, path, arg);
+
+    partial.mirrors = vpkg::mirrors_rank(arg->shared->mirrors, url);
+    arg->partial = &partial;
+
+    // Large files are fetched as several ranges, unless resuming. A size from
+    // the source spares small files the HEAD request.
+    if (partial.start == 0 && (pkg->size == 0 || pkg->size >= VPKG_SEGMENT_MIN_SIZE)) {
+        curl_off_t size = vpkg::partial_probe(&arg->shared->downloader, &partial);
+
+        if (size >= VPKG_SEGMENT_MIN_SIZE) {
+            code = vpkg::partial_segmented(&arg->shared->downloader, &partial, size, VPKG_DOWNLOAD_SEGMENTS, progressfn, arg);
+
+            if (code != CURLE_RANGE_ERROR) {
+                goto out;
+            }
+
+            code = CURLE_OK;
+        }
+    }
 
     for (;;) {
-        xbps_dictionary_t binpkgd;
+        if (vpkg::transfer_init(&transfer, &arg->shared->downloader, partial.mirrors[mirror].c_str()) != 0) {
+            code = CURLE_FAILED_INIT;
+            break;
+        }
 
-        RETRY_EINTR(sem_wait(&arg->shared->sem_prod_cons));
-        RETRY_EINTR(sem_wait(&arg->shared->sem_data));
+        // Rather try another mirror than wait for this one.
+        if (mirror + 1 < partial.mirrors.size()) {
+            transfer.max_attempts = 2;
+        }
 
-        arg->current_offset = arg->shared->next_package.fetch_add(1);
-        if (arg->shared->packages_done >= arg->shared->packages_to_update->size()) {
-            ASSERT_NOERR(sem_post(&arg->shared->sem_data));
-            ASSERT_NOERR(sem_post(&arg->shared->sem_prod_cons));
-            return NULL;
+        code = (code == CURLE_OK) ? curl_easy_setopt(transfer.easy, CURLOPT_XFERINFOFUNCTION, progressfn) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(transfer.easy, CURLOPT_XFERINFODATA, arg) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(transfer.easy, CURLOPT_NOPROGRESS, 0L) : code;
+        code = (code == CURLE_OK && vpkg::partial_setup(&partial, &transfer) != 0) ? CURLE_FAILED_INIT : code;
+        code = (code == CURLE_OK) ? vpkg::downloader_perform(&arg->shared->downloader, &transfer) : code;
+
+        status = 0;
+        curl_easy_getinfo(transfer.easy, CURLINFO_RESPONSE_CODE, &status);
+        vpkg::transfer_fini(&transfer);
+
+        if (code == CURLE_HTTP_RETURNED_ERROR && status == 416 && partial.start > 0) {
+            // The file shrank since the partial download, start over once.
+            if (vpkg::partial_reset(&partial) != 0) {
+                code = CURLE_WRITE_ERROR;
+                break;
+            }
+        } else if (partial.mismatch && mirror + 1 < partial.mirrors.size()) {
+            // An outdated mirror, nothing it sent can be trusted.
+            if (vpkg::partial_reset(&partial) != 0) {
+                code = CURLE_WRITE_ERROR;
+                break;
+            }
+
+            mirror++;
+        } else if (code != CURLE_OK && code != CURLE_WRITE_ERROR && mirror + 1 < partial.mirrors.size()) {
+            // A stalled or failing mirror leaves the rest of the file to the next.
+            mirror++;
+            partial.start = partial.offset;
+        } else {
+            break;
+        }
+
+        code = CURLE_OK;
+    }
+
+out:
+    arg->partial = NULL;
+
+    if (code == CURLE_OK && vpkg::partial_verify(&partial) != 0) {
+        eno = errno;
+    }
+
+    // The extracted files may only be used once the deb is known to be good.
+    if (arg->extracting) {
+        vpkg::debstream_end(&arg->stream, code == CURLE_OK && eno == 0 && !partial.mismatch);
+    }
+
+    // Bytes of another file are of no use to the next attempt.
+    if (partial.mismatch) {
+        vpkg::partial_close(&partial, true);
+        unlink(path);
+        post_error(arg, "failed to download package: size or sha256 differ from the source");
+        return -1;
+    }
+
+    if (eno != 0) {
+        vpkg::partial_close(&partial, false);
+        post_error(arg, "failed to verify package: %s", strerror(eno));
+        return -1;
+    }
+
+    if (vpkg::partial_close(&partial, code == CURLE_OK) != 0 && code == CURLE_OK) {
+        code = CURLE_WRITE_ERROR;
+    }
+
+    if (code != CURLE_OK) {
+        post_error(arg, "failed to download package: %s", curl_easy_strerror(code));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Set arg->deb_package_path to the deb of the current package of arg in the
+ * deb cache, downloading it unless a previous run already did.
+ */
+static int download_package(vpkg_do_update_thread_data *arg)
+{
+    char *deb_package_path;
+    char *part_path;
+    int rv;
+
+    arg->extracting = false;
+
+    deb_package_path = vpkg::debcache_path(&arg->current->second);
+    if (deb_package_path == NULL) {
+        post_error(arg, "failed to format pathname: %s", strerror(ENOMEM));
+        return -1;
+    }
+
+    if (vpkg::debcache_lookup(&arg->shared->debcache, deb_package_path)) {
+        arg->deb_package_path = deb_package_path;
+        return 0;
+    }
+
+    if (asprintf(&part_path, "%s.part", deb_package_path) < 0) {
+        free_preserve_errno(deb_package_path);
+        post_error(arg, "failed to format pathname: %s", strerror(ENOMEM));
+        return -1;
+    }
+
+    {
+        char *url;
+        if (asprintf(&url, "%.*s", (int)arg->current->second.url.size(), arg->current->second.url.data()) < 0) {
+            free_preserve_errno(deb_package_path);
+            free_preserve_errno(part_path);
+            post_error(arg, "failed to format url: %s", strerror(ENOMEM));
+            return -1;
         }
 
-        arg->current = arg->shared->packages_to_update->at(arg->current_offset);
+        rv = download(url, part_path, &arg->current->second, arg);
+        free(url);
+    }
+
+    // The partial download is kept, the next attempt resumes it.
+    if (rv != 0) {
+        stop_extracting(arg);
+        free(deb_package_path);
+        free(part_path);
+        return -1;
+    }
+
+    if (vpkg::debcache_insert(&arg->shared->debcache, part_path, deb_package_path) != 0) {
+        post_error(arg, "failed to store package: %s", strerror(errno));
+        stop_extracting(arg);
+        unlink(part_path);
+        free(deb_package_path);
+        free(part_path);
+        return -1;
+    }
+
+    free(part_path);
+    arg->deb_package_path = deb_package_path;
+    return 0;
+}
+
+/*
+ * Add the binpkg at path with the given sha256 to the index.
+ *
+ * @return its props or NULL after posting an error.
+ */
+static xbps_dictionary_t register_binpkg(vpkg_do_update_thread_data *arg, const char *path, const char *sha256)
+{
+    xbps_dictionary_t binpkgd;
+
+    RETRY_EINTR(sem_wait(&arg->shared->sem_data));
+
+    if ((errno = - index_add_pkg(arg->shared->xhp, arg->shared->idx, arg->shared->idxstage, path, sha256, true)) != 0) {
         ASSERT_NOERR(sem_post(&arg->shared->sem_data));
+        return (xbps_dictionary_t)post_error(arg, "index_add_pkg failed: %s", strerror(errno));
+    }
 
-        // vpkg_progress::ERROR must always come after vpkg_progress::INIT
-        post_state(arg, vpkg_progress::INIT);
+    binpkgd = xbps_archive_fetch_plist(path, "/props.plist");
+    ASSERT_NOERR(sem_post(&arg->shared->sem_data));
 
-        char pkgname[arg->current->first.size() + 1];
-        memcpy(pkgname, arg->current->first.data(), arg->current->first.size());
-        pkgname[arg->current->first.size()] = '\0';
+    if (binpkgd == NULL) {
+        post_error(arg, "failed to register binpkg");
+    }
 
-        binpkgd = xbps_repo_get_pkg(arg->shared->repo, pkgname);
+    return binpkgd;
+}
 
-        // If the package was found and a newer version is available, re-download.
-        if (binpkgd != NULL && xbps_vpkg_gtver(binpkgd, &arg->current->second) != 0) {
-            binpkgd = NULL;
+/*
+ * Convert the deb of arg without xdeb, extracting it first unless that
+ * already happened while it was downloaded. The binpkg is hashed while it is
+ * written, only it is kept.
+ *
+ * @return the binpkg or NULL after posting an error.
+ */
+static xbps_dictionary_t convert_package_native(vpkg_do_update_thread_data *arg, const std::string &datadir, const std::string &destdir, bool extracted)
+{
+    xbps_dictionary_t binpkgd = NULL;
+    vpkg::conversion conversion{};
+    std::error_code ec;
+    struct stat st;
+
+    if (!extracted) {
+        if (stat(arg->deb_package_path, &st) < 0 || vpkg::debstream_start(&arg->stream, arg->deb_package_path, st.st_size, datadir.c_str(), destdir.c_str()) != 0) {
+            post_error(arg, "failed to extract deb: %s", strerror(errno));
+            goto out;
         }
 
-        if (binpkgd) {
-            xbps_object_retain(binpkgd);
-        } else {
-            char *deb_package_path;
-            char *at;
-            CURLcode code;
+        vpkg::debstream_end(&arg->stream, true);
 
-            if (asprintf(&deb_package_path, "%s/%d/%.*s.deb", VPKG_TEMPDIR, gettid(), (int)arg->current->first.size(), arg->current->first.data()) < 0) {
-                return post_error(arg, "failed to format pathname: %s", strerror(ENOMEM));
-            }
+        if (vpkg::debstream_wait(&arg->stream) != 0) {
+            post_error(arg, "failed to extract deb: %s", arg->stream.error.c_str());
+            goto out;
+        }
+    }
 
-            at = strrchr(deb_package_path, '/');
+    conversion.name = arg->current->first;
+    conversion.pkg = &arg->current->second;
+    conversion.shlibs = &arg->shared->shlibs;
+    conversion.arch = arg->shared->xhp->target_arch ? arg->shared->xhp->target_arch : arg->shared->xhp->native_arch;
+    conversion.binpkgs = VPKG_BINPKGS;
+    conversion.threads = arg->shared->convert_threads;
 
-            *at = '\0';
-            if (mkdir(deb_package_path, 0644) < 0 && errno != EEXIST) {
-                free_preserve_errno(deb_package_path);
-                return post_error(arg, "failed to create pkgroot: %s", strerror(errno));
-            }
-            *at = '/';
+    if (vpkg::convert_deb(&conversion, datadir.c_str(), destdir.c_str()) != 0) {
+        post_error(arg, "failed to convert deb: %s", conversion.error.c_str());
+        goto out;
+    }
 
-            {
-                char *url;
-                if (asprintf(&url, "%.*s", (int)arg->current->second.url.size(), arg->current->second.url.data()) < 0) {
-                    free_preserve_errno(deb_package_path);
-                    return post_error(arg, "failed to format url: %s", strerror(ENOMEM));
-                }
+    binpkgd = register_binpkg(arg, conversion.binpkg.c_str(), conversion.sha256);
 
-                FILE *f = fopen(deb_package_path, "w");
-                if (f == NULL) {
-                    free_preserve_errno(deb_package_path);
-                    free_preserve_errno(url);
-                    return post_error(arg, "failed to open destination file: %s", strerror(errno));
-                }
+out:
+    std::filesystem::remove_all(datadir, ec);
+    std::filesystem::remove_all(destdir, ec);
+    return binpkgd;
+}
 
-                code = download(url, f, arg);
+/*
+ * Convert the downloaded deb of arg with xdeb, or in process if the shared
+ * data says so, and add it to the index.
+ *
+ * @return the binpkg or NULL after posting an error.
+ */
+static xbps_dictionary_t convert_package(vpkg_do_update_thread_data *arg)
+{
+    xbps_dictionary_t binpkgd = NULL;
+    char *deb_package_path = arg->deb_package_path;
+    char pkgroot[sizeof(VPKG_TEMPDIR) + 16];
+    bool streamed = arg->extracting;
+    bool extracted = stop_extracting(arg);
+
+    if (make_pkgroot(arg, pkgroot, sizeof(pkgroot)) != 0) {
+        return (xbps_dictionary_t)post_error(arg, "failed to create pkgroot: %s", strerror(errno));
+    }
 
-                fclose(f);
-                free(url);
-            }
+    std::string datadir = std::string{pkgroot} + "/" PKGROOT_DATADIR;
+    std::string destdir = std::string{pkgroot} + "/" PKGROOT_DESTDIR;
 
-            // download all packages first
-            if (code != CURLE_OK) {
-                free_preserve_errno(deb_package_path);
-                return post_error(arg, "failed to download package: %s", curl_easy_strerror(code));
-            }
+    // xdeb extracts the deb again, without what was left of the first try.
+    if (streamed && !extracted) {
+        std::error_code ec;
+        std::filesystem::remove_all(datadir, ec);
+        std::filesystem::remove_all(destdir, ec);
+    }
 
-            post_state(arg, vpkg_progress::XDEB);
+    if (arg->shared->native) {
+        return convert_package_native(arg, datadir, destdir, extracted);
+    }
 
-            int stderr_pipefd[2];
-            if (pipe(stderr_pipefd) < 0) {
-                free_preserve_errno(deb_package_path);
-                return post_error(arg, "failed to create stderr pipe: %s", strerror(errno));
-            }
+    int stderr_pipefd[2];
+    if (pipe(stderr_pipefd) < 0) {
+        return (xbps_dictionary_t)post_error(arg, "failed to create stderr pipe: %s", strerror(errno));
+    }
 
-            int stdout_pipefd[2];
-            if (pipe(stdout_pipefd) < 0) {
-                close(stderr_pipefd[0]);
-                close(stderr_pipefd[1]);
+    int stdout_pipefd[2];
+    if (pipe(stdout_pipefd) < 0) {
+        close(stderr_pipefd[0]);
+        close(stderr_pipefd[1]);
 
-                free_preserve_errno(deb_package_path);
-                return post_error(arg, "failed to create stdout pipe: %s", strerror(errno));
-            }
+        return (xbps_dictionary_t)post_error(arg, "failed to create stdout pipe: %s", strerror(errno));
+    }
 
-            pid_t pid = fork();
-            switch (pid) {
-                int status;
-
-            case -1:
-                close(stdout_pipefd[0]);
-                close(stderr_pipefd[0]);
-                close(stdout_pipefd[1]);
-                close(stderr_pipefd[1]);
-                free_preserve_errno(deb_package_path);
-                return post_error(arg, "failed to fork: %s", strerror(errno));
-            case 0: {
-                char *not_deps, *version, *name, *deps, *replaces, *provides;
-
-                close(stdout_pipefd[0]);
-                close(stderr_pipefd[0]);
-
-                if (dup2(stderr_pipefd[1], STDERR_FILENO) < 0) {
-                    fprintf(stderr, "failed to pipe xdeb errors to vpkg\n");
-                    exit(EXIT_FAILURE);
-                }
+    pid_t pid = fork();
+    switch (pid) {
+        int status;
 
-                if (dup2(stdout_pipefd[1], STDOUT_FILENO) < 0) {
-                    fprintf(stderr, "failed to pipe xdeb output to vpkg\n");
-                    exit(EXIT_FAILURE);
-                }
+    case -1:
+        close(stdout_pipefd[0]);
+        close(stderr_pipefd[0]);
+        close(stdout_pipefd[1]);
+        close(stderr_pipefd[1]);
+        return (xbps_dictionary_t)post_error(arg, "failed to fork: %s", strerror(errno));
+    case 0: {
+        char *not_deps, *version, *name, *deps, *replaces, *provides;
 
-                *at = '\0';
-                if (setenv("XDEB_PKGROOT", deb_package_path, 1) < 0) {
-                    fprintf(stderr, "failed to set environment variable XDEB_PKGROOT\n");
-                    exit(EXIT_FAILURE);
-                }
-                *at = '/';
+        close(stdout_pipefd[0]);
+        close(stderr_pipefd[0]);
 
-                if (setenv("XDEB_BINPKGS", VPKG_BINPKGS, 1) < 0) {
-                    fprintf(stderr, "failed to set environment variable XDEB_BINPKGS\n");
-                    exit(EXIT_FAILURE);
-                }
+        if (dup2(stderr_pipefd[1], STDERR_FILENO) < 0) {
+            fprintf(stderr, "failed to pipe xdeb errors to vpkg\n");
+            exit(EXIT_FAILURE);
+        }
 
-                if (asprintf(&not_deps, "--not-deps=%.*s", (int)arg->current->second.not_deps.size(), arg->current->second.not_deps.data()) < 0 ||
-                    asprintf(&deps, "--deps=%.*s", (int)arg->current->second.deps.size(), arg->current->second.deps.data()) < 0 ||
-                    asprintf(&replaces, "--replaces=%.*s", (int)arg->current->second.replaces.size(), arg->current->second.replaces.data()) < 0 ||
-                    asprintf(&provides, "--provides=%.*s", (int)arg->current->second.provides.size(), arg->current->second.provides.data()) < 0 ||
-                    asprintf(&name, "--name=%.*s", (int)arg->current->first.size(), arg->current->first.data()) < 0 ||
-                    asprintf(&version, "--version=%.*s", (int)arg->current->second.version.size(), arg->current->second.version.data()) < 0) {
-                    // no free in child process
-                    fprintf(stderr, "failed to format xdeb arguments\n");
-                    exit(EXIT_FAILURE);
-                }
+        if (dup2(stdout_pipefd[1], STDOUT_FILENO) < 0) {
+            fprintf(stderr, "failed to pipe xdeb output to vpkg\n");
+            exit(EXIT_FAILURE);
+        }
 
-                execlp("xdeb", "xdeb", "-edRL", not_deps, deps, name, version, replaces, provides, "--", deb_package_path, NULL);
-                fprintf(stderr, "failed to execute xdeb binary\n");
-                exit(EXIT_FAILURE);
-                break;
-            }
+        if (setenv("XDEB_PKGROOT", pkgroot, 1) < 0) {
+            fprintf(stderr, "failed to set environment variable XDEB_PKGROOT\n");
+            exit(EXIT_FAILURE);
+        }
 
-            default: {
-                free(deb_package_path);
+        if (setenv("XDEB_BINPKGS", VPKG_BINPKGS, 1) < 0) {
+            fprintf(stderr, "failed to set environment variable XDEB_BINPKGS\n");
+            exit(EXIT_FAILURE);
+        }
 
-                size_t len;
-                char *buf;
+        if (setenv("XDEB_DATADIR", datadir.c_str(), 1) < 0 || setenv("XDEB_DESTDIR", destdir.c_str(), 1) < 0) {
+            fprintf(stderr, "failed to set environment variables XDEB_DATADIR and XDEB_DESTDIR\n");
+            exit(EXIT_FAILURE);
+        }
 
-                // ignore error, @todo: handle EINTR
-                close(stdout_pipefd[1]);
-                close(stderr_pipefd[1]);
+        if (asprintf(&not_deps, "--not-deps=%.*s", (int)arg->current->second.not_deps.size(), arg->current->second.not_deps.data()) < 0 ||
+            asprintf(&deps, "--deps=%.*s", (int)arg->current->second.deps.size(), arg->current->second.deps.data()) < 0 ||
+            asprintf(&replaces, "--replaces=%.*s", (int)arg->current->second.replaces.size(), arg->current->second.replaces.data()) < 0 ||
+            asprintf(&provides, "--provides=%.*s", (int)arg->current->second.provides.size(), arg->current->second.provides.data()) < 0 ||
+            asprintf(&name, "--name=%.*s", (int)arg->current->first.size(), arg->current->first.data()) < 0 ||
+            asprintf(&version, "--version=%.*s", (int)arg->current->second.version.size(), arg->current->second.version.data()) < 0) {
+            // no free in child process
+            fprintf(stderr, "failed to format xdeb arguments\n");
+            exit(EXIT_FAILURE);
+        }
 
-                if (waitpid(pid, &status, 0) < 0) {
-                    return post_error(arg, "failed to wait for child to complete: %s", strerror(errno));
-                }
+        // With -b xdeb only builds what was extracted while downloading.
+        execlp("xdeb", "xdeb", extracted ? "-bedRL" : "-edRL", not_deps, deps, name, version, replaces, provides, "--", deb_package_path, NULL);
+        fprintf(stderr, "failed to execute xdeb binary\n");
+        exit(EXIT_FAILURE);
+        break;
+    }
 
-                bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
-                buf = read_all_null_no_tr_nl(failed ? stderr_pipefd[0] : stdout_pipefd[0], &len);
+    default: {
+        size_t len;
+        char *buf;
 
-                close(stdout_pipefd[0]);
-                close(stderr_pipefd[0]);
+        // ignore error, @todo: handle EINTR
+        close(stdout_pipefd[1]);
+        close(stderr_pipefd[1]);
 
-                if (failed) {
-                    if (buf == NULL) {
-                        return post_error(arg, "xdeb failed with %d (unable to read output: %s)", WEXITSTATUS(status), strerror(errno));
-                    }
+        if (waitpid(pid, &status, 0) < 0) {
+            return (xbps_dictionary_t)post_error(arg, "failed to wait for child to complete: %s", strerror(errno));
+        }
 
-                    post_error(arg, "xdeb failed with %d:\n%s", WEXITSTATUS(status), buf);
-                } else {
-                    if (buf == NULL) {
-                        return post_error(arg, "failed to parse xdeb output: %s", strerror(errno));
-                    }
+        bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+        buf = read_all_null_no_tr_nl(failed ? stderr_pipefd[0] : stdout_pipefd[0], &len);
 
-                    RETRY_EINTR(sem_wait(&arg->shared->sem_data));
+        close(stdout_pipefd[0]);
+        close(stderr_pipefd[0]);
 
-                    if ((errno = - index_add_pkg(arg->shared->xhp, arg->shared->idx, arg->shared->idxstage, buf, true)) != 0) {
-                        ASSERT_NOERR(sem_post(&arg->shared->sem_data));
-                        return post_error(arg, "index_add_pkg failed: %s", strerror(errno));
-                    }
+        if (failed) {
+            if (buf == NULL) {
+                return (xbps_dictionary_t)post_error(arg, "xdeb failed with %d (unable to read output: %s)", WEXITSTATUS(status), strerror(errno));
+            }
 
-                    binpkgd = xbps_archive_fetch_plist(buf, "/props.plist");
-                    ASSERT_NOERR(sem_post(&arg->shared->sem_data));
-                }
+            post_error(arg, "xdeb failed with %d:\n%s", WEXITSTATUS(status), buf);
+        } else {
+            if (buf == NULL) {
+                return (xbps_dictionary_t)post_error(arg, "failed to parse xdeb output: %s", strerror(errno));
+            }
+
+            char sha256[VPKG_SHA256_HEX_SIZE];
 
+            // Hashed before taking the lock, the other workers only wait for the index.
+            if (vpkg::sha256_file(buf, sha256) != 0) {
+                post_error(arg, "failed to hash binpkg: %s", strerror(errno));
                 free(buf);
+                return NULL;
             }
 
-            }
+            binpkgd = register_binpkg(arg, buf, sha256);
         }
 
-        if (binpkgd == NULL) {
-            return post_error(arg, "failed to register binpkg");
-        }
+        free(buf);
+    }
+
+    }
 
-        post_state(arg, vpkg_progress::DONE);
+    return binpkgd;
+}
 
-        xbps_object_t obj = xbps_dictionary_get(binpkgd, "run_depends");
+/*
+ * Queue the dependencies of binpkgd that have to be installed as well and
+ * give back the slot of the package.
+ */
+static void finish_package(vpkg_do_update_thread_data *arg, xbps_dictionary_t binpkgd)
+{
+    post_state(arg, vpkg_progress::DONE);
 
-        if (obj != NULL) {
-            xbps_array_t arr = static_cast<xbps_array_t>(obj);
-            xbps_object_iterator_t it = xbps_array_iterator(arr);
+    xbps_object_t obj = xbps_dictionary_get(binpkgd, "run_depends");
 
-            while ((obj = xbps_object_iterator_next(it)) != NULL) {
-                xbps_string_t str = static_cast<xbps_string_t>(obj);
-                const char *dep = xbps_string_cstring_nocopy(str);
+    if (obj != NULL) {
+        xbps_array_t arr = static_cast<xbps_array_t>(obj);
+        xbps_object_iterator_t it = xbps_array_iterator(arr);
 
-                if (dep == NULL) {
-                    continue;
-                }
+        while ((obj = xbps_object_iterator_next(it)) != NULL) {
+            xbps_string_t str = static_cast<xbps_string_t>(obj);
+            const char *dep = xbps_string_cstring_nocopy(str);
 
-                size_t dep_len = strlen(dep);
-                char name[dep_len + 1];
+            if (dep == NULL) {
+                continue;
+            }
 
-                if (!xbps_pkgpattern_name(name, dep_len, dep)) {
-                    continue;
-                }
+            size_t dep_len = strlen(dep);
+            char name[dep_len + 1];
 
-                auto it = arg->shared->packages->find(name);
-                if (it == arg->shared->packages->end()) {
-                    continue;
-                }
+            if (!xbps_pkgpattern_name(name, dep_len, dep)) {
+                continue;
+            }
 
-                // Don't install packages that are provided by xbps
-                xbps_dictionary_t xpkg = static_cast<xbps_dictionary_t>(xbps_dictionary_get(arg->shared->xhp->pkgdb, name));
-                if (xpkg != NULL && (!is_xdeb(xpkg) || xbps_vpkg_gtver(xpkg, &it->second) != 1)) {
-                    continue;
-                }
+            auto it = arg->shared->packages->find(name);
+            if (it == arg->shared->packages->end()) {
+                continue;
+            }
 
-                RETRY_EINTR(sem_wait(&arg->shared->sem_data));
+            // Don't install packages that are provided by xbps
+            xbps_dictionary_t xpkg = static_cast<xbps_dictionary_t>(xbps_dictionary_get(arg->shared->xhp->pkgdb, name));
+            if (xpkg != NULL && (!is_xdeb(xpkg) || vpkg::installed_gtver(arg->shared->installed, xpkg, &it->second) != 1)) {
+                continue;
+            }
 
-                if (std::find(arg->shared->packages_to_update->begin(), arg->shared->packages_to_update->end(), it) == arg->shared->packages_to_update->end()) {
-                    arg->shared->packages_to_update->push_back(it);
-                    ASSERT_NOERR(sem_post(&arg->shared->sem_prod_cons));
-                }
+            RETRY_EINTR(sem_wait(&arg->shared->sem_data));
 
-                ASSERT_NOERR(sem_post(&arg->shared->sem_data));
+            if (std::find(arg->shared->packages_to_update->begin(), arg->shared->packages_to_update->end(), it) == arg->shared->packages_to_update->end()) {
+                arg->shared->packages_to_update->push_back(it);
+                ASSERT_NOERR(sem_post(&arg->shared->sem_prod_cons));
             }
 
-            xbps_object_iterator_release(it);
+            ASSERT_NOERR(sem_post(&arg->shared->sem_data));
         }
 
-        RETRY_EINTR(sem_wait(&arg->shared->sem_data));
+        xbps_object_iterator_release(it);
+    }
+
+    RETRY_EINTR(sem_wait(&arg->shared->sem_data));
+
+    if (arg->current_offset < arg->shared->manual_size) {
+        arg->shared->install_xbps.push_back(binpkgd);
+    }
 
-        if (arg->current_offset < arg->shared->manual_size) {
-            arg->shared->install_xbps.push_back(binpkgd);
+    arg->shared->free_slots.push_back(arg);
+
+    if ((arg->shared->packages_done += 1) >= arg->shared->packages_to_update->size()) {
+        RETRY_EINTR(sem_wait(&arg->shared->sem_progress_limit));
+        RETRY_EINTR(tqueue_put_node(&arg->shared->progress_queue, NULL));
+        ASSERT_NOERR(sem_post(&arg->shared->sem_prod_cons));
+    }
+
+    ASSERT_NOERR(sem_post(&arg->shared->sem_data));
+}
+
+/*
+ * First stage: take the next package, download it unless the binpkg
+ * repository already has it and pass it on to the conversion stage.
+ */
+static void *vpkg_download_thread(void *shared_)
+{
+    struct vpkg_do_update_thread_shared_data *shared = static_cast<struct vpkg_do_update_thread_shared_data *>(shared_);
+
+    for (;;) {
+        vpkg_do_update_thread_data *arg;
+        xbps_dictionary_t binpkgd;
+
+        RETRY_EINTR(sem_wait(&shared->sem_prod_cons));
+        RETRY_EINTR(sem_wait(&shared->sem_data));
+
+        if (shared->packages_done >= shared->packages_to_update->size()) {
+            ASSERT_NOERR(sem_post(&shared->sem_data));
+            ASSERT_NOERR(sem_post(&shared->sem_prod_cons));
+            return NULL;
         }
 
-        if ((arg->shared->packages_done += 1) >= arg->shared->packages_to_update->size()) {
-            RETRY_EINTR(sem_wait(&arg->shared->sem_progress_limit));
-            RETRY_EINTR(tqueue_put_node(&arg->shared->progress_queue, NULL));
-            ASSERT_NOERR(sem_post(&arg->shared->sem_prod_cons));
+        // Every stage holds at most as many packages as there are slots.
+        assert(!shared->free_slots.empty());
+        arg = shared->free_slots.back();
+        shared->free_slots.pop_back();
+
+        arg->current_offset = shared->next_package.fetch_add(1);
+        arg->current = shared->packages_to_update->at(arg->current_offset);
+        ASSERT_NOERR(sem_post(&shared->sem_data));
+
+        // vpkg_progress::ERROR must always come after vpkg_progress::INIT
+        post_state(arg, vpkg_progress::INIT);
+
+        char pkgname[arg->current->first.size() + 1];
+        memcpy(pkgname, arg->current->first.data(), arg->current->first.size());
+        pkgname[arg->current->first.size()] = '\0';
+
+        binpkgd = xbps_repo_get_pkg(shared->repo, pkgname);
+
+        // If the package was found and a newer version is available, re-download.
+        if (binpkgd != NULL && xbps_vpkg_gtver(binpkgd, &arg->current->second) != 0) {
+            binpkgd = NULL;
         }
 
-        ASSERT_NOERR(sem_post(&arg->shared->sem_data));
+        if (binpkgd) {
+            xbps_object_retain(binpkgd);
+            finish_package(arg, binpkgd);
+            continue;
+        }
+
+        if (download_package(arg) != 0) {
+            return NULL;
+        }
+
+        auto node = (struct tqueue_node *)malloc(tqueue_sizeof(vpkg_do_update_thread_data *));
+        if (node == NULL) {
+            free(arg->deb_package_path);
+            return post_error(arg, "failed to queue package: %s", strerror(ENOMEM));
+        }
+
+        *(vpkg_do_update_thread_data **)node->data = arg;
+
+        post_state(arg, vpkg_progress::QUEUED);
+
+        RETRY_EINTR(sem_wait(&shared->sem_convert_limit));
+        shared->convert_queued++;
+        RETRY_EINTR(tqueue_put_node(&shared->convert_queue, node));
     }
+}
 
-    return NULL;
+/*
+ * Second stage: convert downloaded packages until a NULL node is received.
+ */
+static void *vpkg_convert_thread(void *shared_)
+{
+    struct vpkg_do_update_thread_shared_data *shared = static_cast<struct vpkg_do_update_thread_shared_data *>(shared_);
+
+    for (;;) {
+        vpkg_do_update_thread_data *arg;
+        xbps_dictionary_t binpkgd;
+        struct tqueue_node *n;
+
+        RETRY_EINTR(tqueue_get_node(&shared->convert_queue, &n));
+        if (n == NULL) {
+            return NULL;
+        }
+
+        ASSERT_NOERR(sem_post(&shared->sem_convert_limit));
+        shared->convert_queued--;
+
+        arg = *(vpkg_do_update_thread_data **)n->data;
+        free(n);
+
+        post_state(arg, vpkg_progress::XDEB);
+
+        binpkgd = convert_package(arg);
+        free(arg->deb_package_path);
+
+        if (binpkgd == NULL) {
+            return NULL;
+        }
+
+        finish_package(arg, binpkgd);
+    }
 }
 
 static int print_bar(struct vpkg_progress *prog)
@@ -543,6 +929,9 @@ static int print_bar(struct vpkg_progress *prog)
     case vpkg_progress::CURL:
         printf("%.*s curl (%ld/%ld)\n", (int)prog->name.size(), prog->name.data(), prog->dlnow, prog->dltotal);
         break;
+    case vpkg_progress::QUEUED:
+        printf("%.*s queued\n", (int)prog->name.size(), prog->name.data());
+        break;
     case vpkg_progress::XDEB:
         printf("%.*s xdeb\n", (int)prog->name.size(), prog->name.data());
         break;
@@ -569,11 +958,10 @@ static int state_cb(const struct xbps_state_cb_data *xscb, void *user_)
     return 0;
 }
 
-static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *packages, std::vector<::vpkg::packages::iterator> *packages_to_update, bool force_install, bool update, bool install)
+static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *packages, vpkg::installed *installed, vpkg::mirrors *mirrors, std::vector<::vpkg::packages::iterator> *packages_to_update, unsigned long ndownload, unsigned long nconvert, bool force_install, bool update, bool install, bool native)
 {
     int rv = 0;
     int npackagesmodified = 0;
-    unsigned long maxthreads;
 
     struct vpkg_do_update_thread_shared_data shared;
 
@@ -584,6 +972,7 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
     shared.packages_done = 0;
     shared.next_package = 0;
     shared.packages = packages;
+    shared.installed = installed;
     shared.xhp = xhp;
     shared.repo = xbps_repo_open(xhp, VPKG_BINPKGS);
     shared.force = force_install;
@@ -620,14 +1009,65 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
         goto out_destroy_sem_progress_limit;
     }
 
-    maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
-    if (maxthreads == (unsigned long)-1) {
-        fprintf(stderr, "failed to get core count: %s, executing using one worker thread.\n", strerror(errno));
-        maxthreads = 1;
+    if (vpkg::downloader_init(&shared.downloader) != 0) {
+        rv = errno;
+        goto out_destroy_queue;
     }
 
+    shared.mirrors = mirrors;
+    shared.downloader.observe = vpkg::mirrors_observe;
+    shared.downloader.observe_user = mirrors;
+
+    if (vpkg::debcache_init(&shared.debcache, VPKG_DEBCACHE_MAX) != 0) {
+        rv = errno;
+        goto out_fini_downloader;
+    }
+
+    if (nconvert == 0) {
+        nconvert = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nconvert == (unsigned long)-1) {
+            fprintf(stderr, "failed to get core count: %s, converting using one worker thread.\n", strerror(errno));
+            nconvert = 1;
+        }
+    }
+
+    if (ndownload == 0) {
+        ndownload = VPKG_DOWNLOAD_JOBS;
+    }
+
+    shared.native = native;
+    shared.convert_threads = 0;
+
+    if (native) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        // The cores are shared by the conversions running at once.
+        if (ncpu > 0 && (unsigned long)ncpu > nconvert) {
+            shared.convert_threads = ncpu / nconvert;
+        }
+
+        if (vpkg::shlibs_load(&shared.shlibs, VPKG_XDEB_SHLIBS) != 0) {
+            rv = errno;
+            goto out_fini_debcache;
+        }
+    }
+
+    // At most one downloaded package per conversion thread is kept waiting.
+    if (tqueue_init(&shared.convert_queue) < 0) {
+        rv = errno;
+        goto out_fini_debcache;
+    }
+
+    if (sem_init(&shared.sem_convert_limit, 0, nconvert) < 0) {
+        rv = errno;
+        goto out_destroy_convert_queue;
+    }
+
+    shared.convert_queued = 0;
+
     /*
-     * Start up to maxthreads threads and output their progress as such:
+     * Start ndownload download and nconvert conversion threads and output
+     * the progress of every package in flight as such:
      *
      * vpkg_progress::CURL:
      *  name0 curl (current/total)
@@ -640,36 +1080,66 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
      * vpkg_progress::DONE:
      *  name1 done
      *  name0 curl (current/total)
+     *
+     * followed by the depth of the queues of both stages.
      */
     {
-        pthread_t threads[maxthreads];
-        struct vpkg_do_update_thread_data thread_data[maxthreads];
-
-        unsigned long numthreads;
-        for (numthreads = 0; numthreads < maxthreads; numthreads++) {
-            thread_data[numthreads].shared = &shared;
-            thread_data[numthreads].tid_local = numthreads;
-
-            if ((errno = pthread_create(&threads[numthreads], NULL, vpkg_do_update_thread, &thread_data[numthreads]))) {
-                if (numthreads == 0) {
-                    fprintf(stderr, "pthread_create failed on first thread: %s, aborting\n", strerror(errno));
-                    goto out_destroy_queue;
-                } else {
-                    fprintf(stderr, "pthread_create failed: %s, executing %ld threads only\n", strerror(errno), numthreads);
-                    break;
-                }
+        // A package in every thread and every place in the conversion queue.
+        unsigned long nslots = ndownload + 2 * nconvert;
+
+        pthread_t threads[ndownload + nconvert];
+        struct vpkg_do_update_thread_data thread_data[nslots];
+
+        for (unsigned long j = nslots; j-- > 0;) {
+            thread_data[j].shared = &shared;
+            thread_data[j].tid_local = j;
+            shared.free_slots.push_back(&thread_data[j]);
+        }
+
+        unsigned long numconvert, numdownload, numthreads;
+
+        // Conversion threads first, they only wait for the download threads.
+        for (numconvert = 0; numconvert < nconvert; numconvert++) {
+            if ((errno = pthread_create(&threads[numconvert], NULL, vpkg_convert_thread, &shared))) {
+                fprintf(stderr, "pthread_create failed: %s, executing %lu conversion threads only\n", strerror(errno), numconvert);
+                break;
+            }
+        }
+
+        for (numdownload = 0; numconvert > 0 && numdownload < ndownload; numdownload++) {
+            if ((errno = pthread_create(&threads[numconvert + numdownload], NULL, vpkg_download_thread, &shared))) {
+                fprintf(stderr, "pthread_create failed: %s, executing %lu download threads only\n", strerror(errno), numdownload);
+                break;
             }
         }
 
-        struct vpkg_progress progress_display[numthreads];
-        int tid_to_offset[numthreads];
+        numthreads = numconvert + numdownload;
+
+        if (numconvert == 0 || numdownload == 0) {
+            fprintf(stderr, "unable to start worker threads, aborting\n");
+
+            for (unsigned long j = 0; j < numconvert; j++) {
+                RETRY_EINTR(tqueue_put_node(&shared.convert_queue, NULL));
+            }
+
+            for (unsigned long j = 0; j < numthreads; j++) {
+                pthread_join(threads[j], NULL);
+            }
+
+            rv = -1;
+            goto out_destroy_sem_convert_limit;
+        }
+
+        struct vpkg_progress progress_display[nslots];
+        int tid_to_offset[nslots];
 
         size_t base_offset = 0;
         size_t nrunning = 0;
+        size_t nprinted = 0;
 
         bool anyerr = false;
         for (;;) {
-            // @fixme: Handle terminal overflow when ws.ws_row < maxthreads.
+            // @fixme: Handle terminal overflow when ws.ws_row < nslots.
             struct tqueue_node *n;
             RETRY_EINTR(tqueue_get_node(&shared.progress_queue, &n));
             ASSERT_NOERR(sem_post(&shared.sem_progress_limit));
@@ -681,31 +1151,31 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
             struct vpkg_progress data = *(struct vpkg_progress *)n->data;
             free(n);
 
-            if (nrunning) {
-                printf("\033[%zuA", nrunning);
+            if (nprinted) {
+                printf("\033[%zuA", nprinted);
             }
 
             switch (data.state) {
             case vpkg_progress::DONE: {
                 assert(nrunning > 0);
 
-                int tid0 = progress_display[base_offset % numthreads].tid_local;
+                int tid0 = progress_display[base_offset % nslots].tid_local;
                 int tid1 = data.tid_local;
 
-                progress_display[tid_to_offset[tid1]] = progress_display[base_offset % numthreads];
-                progress_display[base_offset % numthreads] = data;
+                progress_display[tid_to_offset[tid1]] = progress_display[base_offset % nslots];
+                progress_display[base_offset % nslots] = data;
 
                 tid_to_offset[tid0] = tid_to_offset[tid1];
-                tid_to_offset[tid1] = base_offset % numthreads;
+                tid_to_offset[tid1] = base_offset % nslots;
 
                 print_bar(&data);
                 base_offset++, nrunning--;
                 break;
             }
             case vpkg_progress::INIT: {
-                assert(nrunning < numthreads);
+                assert(nrunning < nslots);
 
-                tid_to_offset[data.tid_local] = (base_offset + nrunning) % numthreads;
+                tid_to_offset[data.tid_local] = (base_offset + nrunning) % nslots;
                 progress_display[tid_to_offset[data.tid_local]] = data;
                 nrunning++;
                 break;
@@ -713,8 +1183,8 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
             case vpkg_progress::ERROR: {
                 assert(nrunning > 0);
 
-                progress_display[tid_to_offset[data.tid_local]] = progress_display[(base_offset + nrunning - 1) % numthreads];
-                progress_display[(base_offset + nrunning - 1) % numthreads] = data;
+                progress_display[tid_to_offset[data.tid_local]] = progress_display[(base_offset + nrunning - 1) % nslots];
+                progress_display[(base_offset + nrunning - 1) % nslots] = data;
                 break;
             }
             default: {
@@ -724,12 +1194,18 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
             }
 
             for (size_t j = base_offset; j < base_offset + nrunning; j++) {
-                if (print_bar(&progress_display[j % numthreads]) == vpkg_progress::ERROR) {
-                    free(progress_display[j % numthreads].error_message);
+                if (print_bar(&progress_display[j % nslots]) == vpkg_progress::ERROR) {
+                    free(progress_display[j % nslots].error_message);
                     anyerr = true;
                 }
             }
 
+            printf("\033[Kqueued: %zu to download, %lu to convert\n",
+                   shared.packages_to_update->size() - std::min(shared.packages_to_update->size(), (size_t)shared.next_package),
+                   (unsigned long)shared.convert_queued);
+
+            nprinted = nrunning + 1;
+
             if (anyerr) {
                 break;
             }
@@ -743,6 +1219,10 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
             }
         }
 
+        for (unsigned long j = 0; j < numconvert; j++) {
+            RETRY_EINTR(tqueue_put_node(&shared.convert_queue, NULL));
+        }
+
         for (unsigned long j = 0; j < numthreads; j++) {
             if ((errno = pthread_join(threads[j], NULL))) {
                 perror("pthread_join");
@@ -781,16 +1261,16 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
         case ENOENT:
             fprintf(stderr, "%s: Not found in repository pool\n", pkgver);
             xbps_object_release(binpkgd);
-            goto out_destroy_queue;
+            goto out_destroy_sem_convert_limit;
         default:
             fprintf(stderr, "%s: Unexpected error: %d\n", pkgver, rv);
             xbps_object_release(binpkgd);
-            goto out_destroy_queue;
+            goto out_destroy_sem_convert_limit;
         }
     }
 
     if (!install) {
-        goto out_destroy_queue;
+        goto out_destroy_sem_convert_limit;
     }
 
     rv = xbps_transaction_prepare(xhp);
@@ -807,11 +1287,11 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
         }
 
         xbps_object_iterator_release(it);
-        goto out_destroy_queue;
+        goto out_destroy_sem_convert_limit;
     }
     default:
         fprintf(stderr, "transaction_prepare: unexpected error: %d\n", rv);
-        goto out_destroy_queue;
+        goto out_destroy_sem_convert_limit;
     }
 
     if (xhp->transd) {
@@ -840,24 +1320,39 @@ static int download_and_install_multi(struct xbps_handle *xhp, vpkg::packages *p
 
     if (npackagesmodified == 0) {
         fprintf(stderr, "Nothing to do.\n");
-        goto out_destroy_queue;
+        goto out_destroy_sem_convert_limit;
     }
 
     rv = yes_no_prompt() ? 0 : -1;
     if (rv != 0) {
         fprintf(stderr, "Aborting!\n");
-        goto out_destroy_queue;
+        goto out_destroy_sem_convert_limit;
     }
 
     rv = xbps_transaction_commit(xhp);
     switch (rv) {
     case 0:
+        if (vpkg::installed_rebuild(installed, xhp) != 0) {
+            perror("failed to update the list of installed packages");
+        }
         break;
     default:
         fprintf(stderr, "Transaction failed: %d\n", rv);
         break;
     }
 
+out_destroy_sem_convert_limit:
+    assert(sem_destroy(&shared.sem_convert_limit) == 0);
+
+out_destroy_convert_queue:
+    assert(tqueue_fini(&shared.convert_queue) == 0);
+
+out_fini_debcache:
+    vpkg::debcache_fini(&shared.debcache);
+
+out_fini_downloader:
+    vpkg::downloader_fini(&shared.downloader);
+
 out_destroy_queue:
     assert(tqueue_fini(&shared.progress_queue) == 0);
 
@@ -889,9 +1384,15 @@ int main(int argc, char **argv)
     bool force = false;
     bool update = false;
     bool install = true;
+    bool native = false;
+    unsigned config_flags = 0;
+    unsigned long ndownload = 0;
+    unsigned long nconvert = 0;
 
     const char *config_path = VPKG_CONFIG_PATH;
     vpkg::config config;
+    vpkg::installed installed;
+    vpkg::mirrors mirrors;
     std::error_code ec;
     std::vector<::vpkg::packages::iterator> to_install;
 
@@ -900,17 +1401,29 @@ int main(int argc, char **argv)
 
     curl_global_init(CURL_GLOBAL_ALL);
 
-    while ((opt = getopt(argc, argv, ":c:vfuNS")) != -1) {
+    while ((opt = getopt(argc, argv, ":c:d:j:vfuxCNS")) != -1) {
         switch (opt) {
+        case 'd':
+            ndownload = parse_jobs(optarg);
+            break;
+        case 'j':
+            nconvert = parse_jobs(optarg);
+            break;
         case 'N':
             install = false;
             break;
         case 'u':
             update = true;
             break;
+        case 'x':
+            native = true;
+            break;
         case 'c':
             config_path = optarg;
             break;
+        case 'C':
+            config_flags |= vpkg::CONFIG_COMPACT;
+            break;
         case 'v':
             fprintf(stderr, "vpkg-%s\n", VPKG_REVISION);
             exit(EXIT_FAILURE);
@@ -954,7 +1467,7 @@ int main(int argc, char **argv)
         }
     }
 
-    if (vpkg::config_init(&config, config_path) != 0) {
+    if (vpkg::config_init(&config, config_path, config_flags) != 0) {
         perror("failed to parse config file");
         goto end_munmap;
     }
@@ -981,6 +1494,11 @@ int main(int argc, char **argv)
         goto end_xbps;
     }
 
+    if (vpkg::installed_init(&installed, &xh) != 0) {
+        perror("failed to list installed packages");
+        goto end_xbps_lock;
+    }
+
     to_install.reserve(argc);
 
     for (int i = 0; i < argc; i++) {
@@ -992,7 +1510,7 @@ int main(int argc, char **argv)
 
         if (!force) {
             auto xpkg = static_cast<xbps_dictionary_t>(xbps_dictionary_get(xh.pkgdb, argv[i]));
-            if (xpkg != NULL && (!is_xdeb(xpkg) || xbps_vpkg_gtver(xpkg, &it->second) != 1)) {
+            if (xpkg != NULL && (!is_xdeb(xpkg) || vpkg::installed_gtver(&installed, xpkg, &it->second) != 1)) {
                 continue;
             }
         }
@@ -1001,19 +1519,18 @@ int main(int argc, char **argv)
     }
 
     if (update && argc == 0) {
-        sem_t sem_data;
-        if ((errno = sem_init(&sem_data, 0, 1)) != 0) {
-            perror("sem_init");
-            goto end_xbps_lock;
-        }
+        for (const vpkg::installed_package &ipkg : installed.packages) {
+            auto it = config.packages.find(ipkg.pkgname);
+            if (it == config.packages.end()) {
+                continue;
+            }
 
-        vpkg_check_update_cb_data cbd;
-        cbd.packages = &config.packages;
-        cbd.force = force;
-        cbd.sem_data = &sem_data;
-        cbd.packages_to_update = &to_install;
+            if (!force && vpkg_gtver(ipkg.pkgver, ipkg.install_time, &it->second) != 1) {
+                continue;
+            }
 
-        xbps_pkgdb_foreach_cb_multi(&xh, vpkg_check_update_cb, &cbd);
+            to_install.push_back(it);
+        }
     } else if (argc == 0) {
         fprintf(stderr, "usage: vpkg-install <package...>\n");
         goto end_xbps_lock;
@@ -1024,10 +1541,17 @@ int main(int argc, char **argv)
         goto end_xbps_lock;
     }
 
-    if (::download_and_install_multi(&xh, &config.packages, &to_install, force, update, install) != 0) {
+    if (vpkg::mirrors_init(&mirrors, config_path) != 0) {
+        perror("failed to load mirrors");
+        goto end_xbps_lock;
+    }
+
+    if (::download_and_install_multi(&xh, &config.packages, &installed, &mirrors, &to_install, ndownload, nconvert, force, update, install, native) != 0) {
         ;
     }
 
+    vpkg::mirrors_fini(&mirrors);
+
     if (std::filesystem::remove_all(VPKG_TEMPDIR, ec) == static_cast<std::uintmax_t>(-1)) {
         fprintf(stderr, "failed to cleanup tempdir\n");
     }
@@ -11,41 +11,264 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <string_view>
+#include <vector>
+
+#include "vpkg/index.hh"
+#include "vpkg/installed.hh"
+#include "vpkg/output.hh"
 #include "vpkg/util.hh"
 
+enum format {
+    FORMAT_TEXT,
+    FORMAT_NUL,
+    FORMAT_JSON,
+};
+
+struct query {
+    char **patterns;
+    int npatterns;
+    enum format format;
+
+    const vpkg::config *config;
+    vpkg::output *out;
+};
+
 static void usage(int code)
 {
-    fprintf(stderr, "usage: vpkg-query [-c <config_path>] [-R] [-lv] <pkgname>\n");
+    fprintf(stderr, "usage: vpkg-query [-c <config_path>] [-R] [-luv] [-0|-j] [<pkgname>...]\n");
     exit(code);
 }
 
-static int vpkg_list_cb(struct xbps_handle *xhp, xbps_object_t obj, const char *pkgname, void *str, bool *)
+static void print_field(const query *q, const char *key, std::string_view value, bool first)
+{
+    if (q->format == FORMAT_NUL) {
+        q->out->write(value);
+        q->out->put('\0');
+        return;
+    }
+
+    q->out->write(first ? "{\"" : ",\"");
+    q->out->write(key);
+    q->out->write("\":");
+    q->out->json_string(value);
+}
+
+/*
+ * Print one result. Text output is just the name. Records of -0 consist of the
+ * fields below in this order, each terminated by NUL, followed by a newline.
+ * -j prints one JSON object per line. The installed version is only part of
+ * -l records, the pattern only if there are several patterns. sha256 and size
+ * are left out of JSON objects if the source did not publish them.
+ */
+static void print_record(const query *q, int i, std::string_view name, const vpkg::package *pkg, const char *installed)
+{
+    static const vpkg::package none;
+    vpkg::output *out = q->out;
+    bool first = true;
+
+    if (q->format == FORMAT_TEXT) {
+        if (q->npatterns > 1) {
+            out->write(q->patterns[i]);
+            out->put('\t');
+        }
+
+        out->write(name);
+        out->put('\n');
+        return;
+    }
+
+    pkg = pkg ? pkg : &none;
+
+    if (q->npatterns > 1) {
+        print_field(q, "pattern", q->patterns[i], first);
+        first = false;
+    }
+
+    print_field(q, "name", name, first);
+
+    if (installed) {
+        print_field(q, "installed", installed, false);
+    }
+
+    print_field(q, "version", pkg->version, false);
+    print_field(q, "url", pkg->url, false);
+    print_field(q, "deps", pkg->deps, false);
+    print_field(q, "not_deps", pkg->not_deps, false);
+    print_field(q, "replaces", pkg->replaces, false);
+    print_field(q, "provides", pkg->provides, false);
+
+    if (q->format == FORMAT_NUL) {
+        out->number(pkg->last_modified);
+        out->put('\0');
+
+        // Fields are positional, unknown ones are empty.
+        print_field(q, "sha256", pkg->sha256, false);
+
+        if (pkg->size != 0) {
+            out->number(pkg->size);
+        }
+
+        out->write(std::string_view{"\0\n", 2});
+    } else {
+        out->write(",\"last_modified\":");
+        out->number(pkg->last_modified);
+
+        if (!pkg->sha256.empty()) {
+            print_field(q, "sha256", pkg->sha256, false);
+        }
+
+        if (pkg->size != 0) {
+            out->write(",\"size\":");
+            out->number(pkg->size);
+        }
+
+        out->write("}\n");
+    }
+}
+
+static void print_available(const query *q, int i, const ::vpkg::packages::iterator &it)
+{
+    // Only the names are needed for text output, don't decode the packages.
+    if (q->format == FORMAT_TEXT) {
+        print_record(q, i, it.raw().first, NULL, NULL);
+    } else {
+        print_record(q, i, it->first, &it->second, NULL);
+    }
+}
+
+static void list_installed(const query *q, const vpkg::installed *installed)
+{
+    for (const vpkg::installed_package &ipkg : installed->packages) {
+        const vpkg::package *pkg = NULL;
+
+        if (q->format != FORMAT_TEXT) {
+            auto it = q->config->packages.find(ipkg.pkgname);
+            if (it != q->config->packages.end()) {
+                pkg = &it->second;
+            }
+        }
+
+        if (q->npatterns == 0) {
+            print_record(q, 0, ipkg.pkgname, pkg, ipkg.pkgver);
+        }
+
+        for (int i = 0; i < q->npatterns; i++) {
+            if (strstr(ipkg.pkgname, q->patterns[i])) {
+                print_record(q, i, ipkg.pkgname, pkg, ipkg.pkgver);
+            }
+        }
+    }
+}
+
+static void print_outdated(const query *q, int i, const vpkg::installed_package *ipkg, const vpkg::package *pkg)
+{
+    vpkg::output *out = q->out;
+    const char *version;
+
+    if (q->format != FORMAT_TEXT) {
+        print_record(q, i, ipkg->pkgname, pkg, ipkg->pkgver);
+        return;
+    }
+
+    if (q->npatterns > 1) {
+        out->write(q->patterns[i]);
+        out->put('\t');
+    }
+
+    version = xbps_pkg_version(ipkg->pkgver);
+
+    out->write(ipkg->pkgname);
+    out->put(' ');
+    out->write(version ? version : ipkg->pkgver);
+    out->write(" -> ");
+
+    // Unversioned packages are only known by the time they were modified.
+    if (pkg->version.size()) {
+        out->write(pkg->version);
+    } else {
+        out->number(pkg->last_modified);
+    }
+
+    out->put('\n');
+}
+
+/*
+ * Print the installed packages that vpkg-install -u would update. Only the
+ * list of installed packages and the config are read, the pkgdb is not locked.
+ */
+static void list_outdated(const query *q, const vpkg::installed *installed)
+{
+    for (const vpkg::installed_package &ipkg : installed->packages) {
+        auto it = q->config->packages.find(ipkg.pkgname);
+        if (it == q->config->packages.end()) {
+            continue;
+        }
+
+        if (vpkg_gtver(ipkg.pkgver, ipkg.install_time, &it->second) != 1) {
+            continue;
+        }
+
+        if (q->npatterns == 0) {
+            print_outdated(q, 0, &ipkg, &it->second);
+        }
+
+        for (int i = 0; i < q->npatterns; i++) {
+            if (strstr(ipkg.pkgname, q->patterns[i])) {
+                print_outdated(q, i, &ipkg, &it->second);
+            }
+        }
+    }
+}
+
+/*
+ * Print all available packages whose name contains pattern i. The trigram
+ * table of the index narrows down the names that have to be compared.
+ */
+static void list_repository(const query *q, std::vector<::vpkg::packages::iterator> *sorted, int i)
 {
-    xbps_dictionary_t dict = static_cast<xbps_dictionary_t>(obj);
-    assert(xbps_object_type(obj) == XBPS_TYPE_DICTIONARY);
+    const vpkg::config *config = q->config;
+    std::vector<uint32_t> candidates;
+    const char *pattern = q->patterns[i];
+    size_t len = strlen(pattern);
+
+    if (config->index != NULL && vpkg::index_candidates(config->index, pattern, &candidates) == 0) {
+        for (uint32_t c : candidates) {
+            auto it = config->packages.nth(c);
+            auto name = it.raw().first;
+
+            if (memmem(name.data(), name.size(), pattern, len)) {
+                print_available(q, i, it);
+            }
+        }
 
-    if (!is_xdeb(dict)) {
-        return 0;
+        return;
     }
 
-    if (!str || strstr(pkgname, (const char *)str)) {
-        printf("%s\n", pkgname);
+    if (sorted->empty()) {
+        *sorted = config->packages.sorted();
     }
 
-    return 0;
+    for (auto &it : *sorted) {
+        auto name = it.raw().first;
+
+        if (memmem(name.data(), name.size(), pattern, len)) {
+            print_available(q, i, it);
+        }
+    }
 }
 
 int main(int argc, char **argv)
 {
     const char *config_path = VPKG_CONFIG_PATH;
 
-    const char *filter_pkgname = NULL;
-    size_t filter_pkgname_length = 0;
-
     bool list = false;
+    bool outdated = false;
     bool repository = false;
 
     vpkg::config config;
+    vpkg::output out{STDOUT_FILENO};
+    query q = {NULL, 0, FORMAT_TEXT, &config, &out};
     struct xbps_handle xh;
     int rv = EXIT_FAILURE;
     int ch;
@@ -53,7 +276,7 @@ int main(int argc, char **argv)
     memset(&xh, 0, sizeof(xh));
 
     // Options
-    while ((ch = getopt(argc, argv, ":c:Rlv")) != -1) {
+    while ((ch = getopt(argc, argv, ":c:Rluv0j")) != -1) {
         switch (ch) {
         case 'R':
             repository = true;
@@ -64,6 +287,15 @@ int main(int argc, char **argv)
         case 'l':
             list = true;
             break;
+        case 'u':
+            outdated = true;
+            break;
+        case '0':
+            q.format = FORMAT_NUL;
+            break;
+        case 'j':
+            q.format = FORMAT_JSON;
+            break;
         case 'v':
             fprintf(stderr, "vpkg-%s\n", VPKG_REVISION);
             exit(EXIT_FAILURE);
@@ -76,12 +308,12 @@ int main(int argc, char **argv)
 
     argc -= optind, argv += optind;
 
-    if (argc) {
-        filter_pkgname = argv[0];
-        filter_pkgname_length = strlen(argv[0]);
-    }
+    q.patterns = argv;
+    q.npatterns = argc;
 
-    if (vpkg::config_init(&config, config_path) != 0) {
+    // A query must not write anything, it may run next to vpkg-install and
+    // vpkg-sync or without permission to.
+    if (vpkg::config_init(&config, config_path, vpkg::CONFIG_READONLY) != 0) {
         perror("failed to parse config file");
         goto end_munmap;
     }
@@ -91,17 +323,41 @@ int main(int argc, char **argv)
         goto out;
     }
 
-    if (list && repository) {
-        for (auto &it : config.packages) {
-            if (!filter_pkgname || memmem(it.first.data(), it.first.size(), filter_pkgname, filter_pkgname_length)) {
-                fprintf(stderr, "%.*s\n", (int)it.first.size(), it.first.data());
+    if (outdated) {
+        vpkg::installed installed;
+
+        if (vpkg::installed_init(&installed, &xh, vpkg::INSTALLED_READONLY) != 0) {
+            perror("failed to list installed packages");
+            goto end_xbps;
+        }
+
+        list_outdated(&q, &installed);
+    } else if (list && repository) {
+        std::vector<::vpkg::packages::iterator> sorted;
+
+        if (q.npatterns == 0) {
+            for (auto &it : config.packages.sorted()) {
+                print_available(&q, 0, it);
             }
         }
+
+        for (int i = 0; i < q.npatterns; i++) {
+            list_repository(&q, &sorted, i);
+        }
     } else if (list) {
-        if (xbps_pkgdb_foreach_cb(&xh, vpkg_list_cb, (void *)filter_pkgname) != 0) {
-            fprintf(stderr, "xbps initialization failed\n");
-            goto out;
+        vpkg::installed installed;
+
+        if (vpkg::installed_init(&installed, &xh, vpkg::INSTALLED_READONLY) != 0) {
+            perror("failed to list installed packages");
+            goto end_xbps;
         }
+
+        list_installed(&q, &installed);
+    }
+
+    if (out.flush() != 0) {
+        perror("failed to write output");
+        goto end_xbps;
     }
 
     rv = EXIT_SUCCESS;
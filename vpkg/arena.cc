@@ -0,0 +1,77 @@
+#include "vpkg/arena.hh"
+
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+
+vpkg::arena::~arena()
+{
+    while (head_ != nullptr) {
+        chunk *next = head_->next;
+
+        if (head_->size >= HUGE_CHUNK_SIZE) {
+            munmap(head_, sizeof(chunk) + head_->size);
+        } else {
+            free(head_);
+        }
+
+        head_ = next;
+    }
+}
+
+void *vpkg::arena::alloc(size_t size, size_t align)
+{
+    chunk *c;
+
+    if (head_ != nullptr) {
+        uintptr_t base = (uintptr_t)(head_ + 1);
+        uintptr_t at = (base + head_->used + align - 1) & ~(uintptr_t)(align - 1);
+
+        if (at + size <= base + head_->size) {
+            head_->used = at + size - base;
+            return (void *)at;
+        }
+    }
+
+    // Oversized requests get a chunk of their own.
+    size_t chunk_size = size + align > CHUNK_SIZE ? size + align : CHUNK_SIZE;
+
+    /*
+     * A table of many packages is written right after it was allocated, so
+     * most of its cost are page faults. Huge pages take 512 times fewer.
+     */
+    if (chunk_size >= HUGE_CHUNK_SIZE) {
+        void *mem = mmap(NULL, sizeof(chunk) + chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+
+        madvise(mem, sizeof(chunk) + chunk_size, MADV_HUGEPAGE);
+        c = static_cast<chunk *>(mem);
+    } else {
+        c = static_cast<chunk *>(malloc(sizeof(chunk) + chunk_size));
+        if (c == nullptr) {
+            return nullptr;
+        }
+    }
+
+    c->next = head_;
+    c->size = chunk_size;
+    c->used = 0;
+
+    head_ = c;
+
+    return alloc(size, align);
+}
+
+size_t vpkg::arena::size() const
+{
+    size_t size = 0;
+
+    for (const chunk *c = head_; c != nullptr; c = c->next) {
+        size += sizeof(chunk) + c->size;
+    }
+
+    return size;
+}
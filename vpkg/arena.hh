@@ -0,0 +1,50 @@
+#ifndef VPKG_ARENA_HH_
+#define VPKG_ARENA_HH_
+
+#include <stddef.h>
+
+namespace vpkg {
+/*!
+ * Bump allocator. Memory is only released all at once, when the arena is
+ * destroyed. Objects allocated from the arena are never destructed.
+ */
+class arena {
+public:
+    arena() = default;
+    arena(const arena &) = delete;
+    arena &operator=(const arena &) = delete;
+    ~arena();
+
+    /*!
+     * @return suitably aligned, uninitialized memory or NULL if out of memory.
+     */
+    void *alloc(size_t size, size_t align = alignof(max_align_t));
+
+    template<typename T>
+    T *alloc_array(size_t n)
+    {
+        return static_cast<T *>(alloc(n * sizeof(T), alignof(T)));
+    }
+
+    /*!
+     * @return the bytes held by the arena, used or not.
+     */
+    size_t size() const;
+
+private:
+    struct chunk {
+        chunk *next;
+        size_t size;
+        size_t used;
+    };
+
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    // Larger chunks are mapped directly and backed by huge pages if possible.
+    static constexpr size_t HUGE_CHUNK_SIZE = 2 << 20;
+
+    chunk *head_ = nullptr;
+};
+}
+
+#endif // VPKG_ARENA_HH_
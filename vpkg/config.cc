@@ -1,125 +1,924 @@
 #include "vpkg/config.hh"
 
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <pwd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
 #include "simdini/ini.h"
 
+#include "vpkg/hash.hh"
+#include "vpkg/index.hh"
+#include "vpkg/util.hh"
+#include "vpkg/version.hh"
+
+// Chunks smaller than this are not worth a thread.
+#define CONFIG_CHUNK_MIN (4 << 20)
+
+enum resolution {
+    SKIP,
+    REPLACE,
+    OVERLAY,
+};
+
+enum field {
+    FIELD_URL = 1 << 0,
+    FIELD_DEPS = 1 << 1,
+    FIELD_NOT_DEPS = 1 << 2,
+    FIELD_REPLACES = 1 << 3,
+    FIELD_PROVIDES = 1 << 4,
+    FIELD_LAST_MODIFIED = 1 << 5,
+    FIELD_SHA256 = 1 << 6,
+    FIELD_SIZE = 1 << 7,
+};
+
+/*
+ * A decoded, but not yet deduplicated section.
+ */
+struct config_section {
+    std::string_view name;
+    uint64_t hash;
+    vpkg::package pkg;
+    unsigned fields;
+};
+
+/*
+ * Byte range of a section, from its header up to the next one. Lazily decoded
+ * packages hold a list of all sections that contribute to them.
+ */
+struct lazy_section {
+    const char *data;
+    size_t len;
+    lazy_section *next;
+};
+
+struct config_chunk {
+    const char *data;
+    size_t len;
+    size_t shard;
+
+    std::vector<config_section> sections;
+    int rc;
+    int eno;
+};
+
+struct config_worker {
+    std::vector<config_chunk> *chunks;
+    std::atomic<size_t> *next;
+    pthread_t thread;
+};
+
+/*
+ * Duplicate sections are resolved by version: a newer version replaces the
+ * package, an older one is ignored. Unversioned or equally versioned
+ * duplicates are merged, later keys take precedence.
+ */
+static enum resolution resolve(const vpkg::package *existing, std::string_view version)
+{
+    if (version.empty() || existing->version.empty()) {
+        return OVERLAY;
+    }
+
+    switch (vpkg::version_cmp(version, existing->version)) {
+    case -1:
+        return SKIP;
+    case 0:
+        return OVERLAY;
+    default:
+        return REPLACE;
+    }
+}
+
+static void overlay_section(vpkg::package *pkg, const config_section *sec)
+{
+    const vpkg::package *in = &sec->pkg;
+
+    if (sec->fields & FIELD_URL) pkg->url = in->url;
+    if (sec->fields & FIELD_DEPS) pkg->deps = in->deps;
+    if (sec->fields & FIELD_NOT_DEPS) pkg->not_deps = in->not_deps;
+    if (sec->fields & FIELD_REPLACES) pkg->replaces = in->replaces;
+    if (sec->fields & FIELD_PROVIDES) pkg->provides = in->provides;
+    if (sec->fields & FIELD_LAST_MODIFIED) pkg->last_modified = in->last_modified;
+    if (sec->fields & FIELD_SHA256) pkg->sha256 = in->sha256;
+    if (sec->fields & FIELD_SIZE) pkg->size = in->size;
+    if (in->version.size()) pkg->version = in->version;
+}
+
+static int apply_section(::vpkg::packages *packages, const config_section *sec)
+{
+    auto [iterator, inserted] = packages->insert({sec->name, {}}, sec->hash);
+    if (iterator == packages->end()) {
+        return -1;
+    }
+
+    vpkg::package *pkg = &iterator->second;
+
+    switch (inserted ? REPLACE : resolve(pkg, sec->pkg.version)) {
+    case SKIP:
+        break;
+    case REPLACE:
+        *pkg = sec->pkg;
+        break;
+    case OVERLAY:
+        overlay_section(pkg, sec);
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Split "name-version" into name and version. The version starts after the
+ * last dash, if it is followed by a digit.
+ */
+static std::string_view split_section(std::string_view section, std::string_view *version)
+{
+    const char *at = (const char *)memrchr(section.data(), '-', section.size());
+
+    if (at && isdigit(at[1])) {
+        size_t off = at - section.data();
+        *version = section.substr(off + 1);
+        return section.substr(0, off);
+    }
+
+    *version = std::string_view{};
+    return section;
+}
+
+static int decode_key(config_section *sec, std::string_view key, std::string_view value)
+{
+    if (key == "url") {
+        sec->pkg.url = value;
+        sec->fields |= FIELD_URL;
+    } else if (key == "deps") {
+        sec->pkg.deps = value;
+        sec->fields |= FIELD_DEPS;
+    } else if (key == "not_deps") {
+        sec->pkg.not_deps = value;
+        sec->fields |= FIELD_NOT_DEPS;
+    } else if (key == "replaces") {
+        sec->pkg.replaces = value;
+        sec->fields |= FIELD_REPLACES;
+    } else if (key == "provides") {
+        sec->pkg.provides = value;
+        sec->fields |= FIELD_PROVIDES;
+    } else if (key == "last_modified") {
+        char *end;
+        int eno = errno;
+
+        unsigned long last_modified = strtoul(value.data(), &end, 10);
+        if (errno != eno || *end != '\n' || end == value.data()) {
+            fprintf(stderr, "unable to parse timestamp\n");
+            return 1;
+        }
+
+        sec->pkg.last_modified = (time_t)last_modified;
+        sec->fields |= FIELD_LAST_MODIFIED;
+    } else if (key == "sha256") {
+        if (!vpkg::sha256_valid(value)) {
+            fprintf(stderr, "invalid sha256: %.*s\n", (int)value.size(), value.data());
+            return 1;
+        }
+
+        sec->pkg.sha256 = value;
+        sec->fields |= FIELD_SHA256;
+    } else if (key == "size") {
+        char *end;
+        int eno = errno;
+
+        unsigned long long size = strtoull(value.data(), &end, 10);
+        if (errno != eno || *end != '\n' || end == value.data()) {
+            fprintf(stderr, "unable to parse size\n");
+            return 1;
+        }
+
+        sec->pkg.size = (uint64_t)size;
+        sec->fields |= FIELD_SIZE;
+    } else {
+        fprintf(stderr, "invalid key: %.*s\n", (int)key.size(), key.data());
+        return 1;
+    }
+
+    return 0;
+}
+
 static int cb_ini_vpkg_config(const char *s_, size_t sl_, const char *k_, size_t kl_, const char *v_, size_t vl_, void *user_)
 {
-    ::vpkg::packages *user = static_cast<::vpkg::packages *>(user_);
+    config_chunk *user = static_cast<config_chunk *>(user_);
+
+    if (s_ == NULL || sl_ == 0) {
+        fprintf(stderr, "Not supported!\n");
+        return 1;
+    }
+
+    // Keys of the same section share the section pointer.
+    if (user->sections.empty() || user->sections.back().name.data() != s_) {
+        auto version = std::string_view{};
+        auto section = split_section(std::string_view{s_, sl_}, &version);
+
+        config_section sec{section, vpkg::packages_hash(section), {}, 0};
+        sec.pkg.version = version;
+
+        user->sections.push_back(sec);
+    }
+
+    return decode_key(&user->sections.back(), std::string_view{k_, kl_}, std::string_view{v_, vl_});
+}
+
+/*
+ * Check every key like cb_ini_vpkg_config does, without keeping anything.
+ */
+static int cb_ini_validate(const char *s_, size_t sl_, const char *k_, size_t kl_, const char *v_, size_t vl_, void *user_)
+{
+    config_section sec{};
+
+    (void)user_;
+
+    if (s_ == NULL || sl_ == 0) {
+        fprintf(stderr, "Not supported!\n");
+        return 1;
+    }
+
+    return decode_key(&sec, std::string_view{k_, kl_}, std::string_view{v_, vl_});
+}
+
+static size_t count_sections(const char *data, size_t len)
+{
+    const char *end = data + len;
+    size_t n = 0;
+
+    for (const char *at = data; at < end; at++) {
+        if (*at == '[') {
+            n++;
+        }
+
+        if ((at = (const char *)memchr(at, '\n', end - at)) == NULL) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+static void parse_chunk(config_chunk *arg)
+{
+    arg->rc = 0;
+    arg->sections.reserve(count_sections(arg->data, arg->len));
 
-    auto section = s_ ? std::string_view{s_, sl_} : std::string_view{""};
-    auto key = std::string_view{k_, kl_};
-    auto value = std::string_view{v_, vl_};
-    auto version = std::string_view{};
-    const char *at;
+    errno = 0;
+    if (!ini_parse_string(arg->data, arg->len, cb_ini_vpkg_config, arg)) {
+        arg->rc = -1;
+        arg->eno = errno ? errno : EINVAL;
+    }
+}
+
+static void *parse_worker_thread(void *arg_)
+{
+    config_worker *arg = static_cast<config_worker *>(arg_);
+    size_t i;
 
-    if ((at = (const char *)memrchr(s_, '-', sl_)) && isdigit(at[1])) {
-        int off = at - s_;
-        version = std::string_view{section.begin() + off + 1, section.end()};
-        section = section.substr(0, off);
+    while ((i = arg->next->fetch_add(1)) < arg->chunks->size()) {
+        parse_chunk(&(*arg->chunks)[i]);
     }
 
-    auto [iterator, inserted] = user->insert(std::pair<std::string_view, vpkg::package>{section, {}});
+    return NULL;
+}
+
+/*
+ * Split the ini at section boundaries into nchunks chunks, appended to chunks.
+ */
+static void split_chunks(std::vector<config_chunk> *chunks, size_t shard, const char *data, size_t len, size_t nchunks)
+{
+    const char *end = data + len;
+    const char *at = data;
 
-    if (!inserted && version.size() && iterator->second.version.size()) {
-        char this_pkgver[version.size() + 1] = {0};
-        char other_pkgver[iterator->second.version.size() + 1] = {0};
+    for (size_t i = 0; i < nchunks && at < end; i++) {
+        const char *next = end;
 
-        memcpy(this_pkgver, version.data(), version.size());
-        memcpy(other_pkgver, iterator->second.version.data(), iterator->second.version.size());
+        // Move the split point forward to the start of the next section.
+        if (i + 1 < nchunks) {
+            const char *split = std::max(at, data + len / nchunks * (i + 1));
 
-        if (xbps_cmpver(this_pkgver, other_pkgver) < 0) {
-            return 0;
+            next = (const char *)memmem(split, end - split, "\n[", 2);
+            next = next ? next + 1 : end;
         }
+
+        config_chunk chunk;
+        chunk.data = at;
+        chunk.len = next - at;
+        chunk.shard = shard;
+        chunks->push_back(std::move(chunk));
+
+        at = next;
     }
+}
+
+/*
+ * Decode the chunks on up to nthreads threads. Duplicates are resolved
+ * afterwards, in chunk order, so the result does not depend on how the files
+ * were split.
+ */
+static int parse_ini(::vpkg::packages *packages, std::vector<config_chunk> *chunks, size_t nthreads)
+{
+    std::vector<config_worker> workers(std::min(nthreads, chunks->size()));
+    std::atomic<size_t> next{0};
+    size_t nstarted;
+    size_t total = 0;
 
-    if (inserted && version.size()) {
-        iterator->second.version = version;
+    if (workers.empty()) {
+        return 0;
     }
 
-    if (section.size()) {
-        if (key == "url") {
-            iterator->second.url = value;
-        } else if (key == "deps") {
-            iterator->second.deps = value;
-        } else if (key == "not_deps") {
-            iterator->second.not_deps = value;
-        } else if (key == "replaces") {
-            iterator->second.replaces = value;
-        } else if (key == "provides") {
-            iterator->second.provides = value;
-        } else if (key == "last_modified") {
-            char *end;
-            int eno = errno;
+    for (config_worker &w : workers) {
+        w.chunks = chunks;
+        w.next = &next;
+    }
 
-            unsigned long last_modified = strtoul(value.data(), &end, 10);
-            if (errno != eno || *end != '\n' || end == value.data()) {
-                fprintf(stderr, "unable to parse timestamp\n");
-                return 1;
+    // The calling thread always takes part.
+    for (nstarted = 1; nstarted < workers.size(); nstarted++) {
+        if ((errno = pthread_create(&workers[nstarted].thread, NULL, parse_worker_thread, &workers[nstarted])) != 0) {
+            break;
+        }
+    }
+
+    parse_worker_thread(&workers[0]);
+
+    for (size_t i = 1; i < nstarted; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    for (const config_chunk &chunk : *chunks) {
+        if (chunk.rc != 0) {
+            errno = chunk.eno;
+            return -1;
+        }
+
+        total += chunk.sections.size();
+    }
+
+    if (packages->reserve(packages->size() + total) != 0) {
+        return -1;
+    }
+
+    for (const config_chunk &chunk : *chunks) {
+        for (const config_section &sec : chunk.sections) {
+            if (apply_section(packages, &sec) != 0) {
+                return -1;
             }
+        }
+    }
 
-            iterator->second.last_modified = (time_t)last_modified;
-        } else {
-            fprintf(stderr, "invalid key: %.*s\n", (int)key.size(), key.data());
-            return 1;
+    return 0;
+}
+
+/*
+ * The sections were validated by scan_ini, so this can not fail.
+ */
+static void decode_lazy(vpkg::package *pkg, const void *source)
+{
+    std::string_view version = pkg->version;
+
+    for (auto sec = static_cast<const lazy_section *>(source); sec != NULL; sec = sec->next) {
+        config_chunk chunk;
+
+        chunk.data = sec->data;
+        chunk.len = sec->len;
+        parse_chunk(&chunk);
+
+        for (const config_section &s : chunk.sections) {
+            overlay_section(pkg, &s);
+        }
+    }
+
+    // The version was already resolved when scanning.
+    pkg->version = version;
+}
+
+/*
+ * Only record the name, version and byte range of every section. Duplicates
+ * are resolved by version just like in parse_ini, the keys are decoded by
+ * decode_lazy when a package is first accessed. The keys are still checked
+ * up front, so a malformed section fails just like it does in parse_ini.
+ */
+static int scan_ini(::vpkg::packages *packages, const char *data, size_t len)
+{
+    const char *end = data + len;
+    const char *at = data;
+
+    errno = 0;
+    if (!ini_parse_string(data, len, cb_ini_validate, NULL)) {
+        errno = errno ? errno : EINVAL;
+        return -1;
+    }
+
+    if (packages->reserve(packages->size() + count_sections(data, len)) != 0) {
+        return -1;
+    }
+
+    packages->set_decoder(decode_lazy);
+
+    while (at < end) {
+        const char *eol = (const char *)memchr(at, '\n', end - at);
+        eol = eol ? eol : end;
+
+        if (*at != '[') {
+            at = eol + 1;
+            continue;
+        }
+
+        const char *close = (const char *)memchr(at, ']', eol - at);
+        if (close == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        const char *next = (const char *)memmem(eol, end - eol, "\n[", 2);
+        next = next ? next + 1 : end;
+
+        auto version = std::string_view{};
+        auto section = split_section(std::string_view{at + 1, (size_t)(close - at - 1)}, &version);
+
+        lazy_section *sec = packages->arena().alloc_array<lazy_section>(1);
+        if (sec == NULL) {
+            return -1;
+        }
+
+        *sec = lazy_section{at, (size_t)(next - at), NULL};
+
+        auto [iterator, inserted] = packages->insert({section, {}}, vpkg::packages_hash(section), sec);
+        if (iterator == packages->end()) {
+            return -1;
+        }
+
+        vpkg::package *pkg = &iterator.raw().second;
+
+        switch (inserted ? REPLACE : resolve(pkg, version)) {
+        case SKIP:
+            break;
+        case REPLACE:
+            pkg->version = version;
+            iterator.source() = sec;
+            break;
+        case OVERLAY: {
+            auto tail = (lazy_section *)iterator.source();
+            while (tail->next != NULL) {
+                tail = tail->next;
+            }
+
+            tail->next = sec;
+
+            if (version.size()) {
+                pkg->version = version;
+            }
+            break;
+        }
+        }
+
+        at = next;
+    }
+
+    return 0;
+}
+
+/*
+ * Split every version once, checking installed packages for updates compares
+ * against these keys.
+ */
+static int compute_version_keys(::vpkg::packages *packages)
+{
+    int32_t buf[VERSION_KEY_MAX];
+
+    for (auto it = packages->begin(); it != packages->end(); ++it) {
+        vpkg::package *pkg = &it.raw().second;
+        vpkg::version_key key;
+
+        if (pkg->vkey.v != NULL || pkg->version.empty()) {
+            continue;
+        }
+
+        // Left unset, compared as a string instead.
+        if (vpkg::version_key_init(&key, buf, VERSION_KEY_MAX, pkg->version, true) != 0) {
+            continue;
+        }
+
+        int32_t *v = packages->arena().alloc_array<int32_t>(key.n ? key.n : 1);
+        if (v == NULL) {
+            return -1;
         }
+
+        memcpy(v, buf, key.n * sizeof(*v));
+        key.v = v;
+        pkg->vkey = key;
+    }
+
+    return 0;
+}
+
+static void write_field(FILE *f, const char *key, std::string_view value)
+{
+    if (value.size()) {
+        fprintf(f, "%s = %.*s\n", key, (int)value.size(), value.data());
+    }
+}
+
+static void write_package(FILE *f, std::string_view name, const vpkg::package *pkg)
+{
+    if (pkg->version.size()) {
+        fprintf(f, "[%.*s-%.*s]\n", (int)name.size(), name.data(), (int)pkg->version.size(), pkg->version.data());
     } else {
-        fprintf(stderr, "Not supported!\n");
-        return 1;
+        fprintf(f, "[%.*s]\n", (int)name.size(), name.data());
+    }
+
+    write_field(f, "url", pkg->url);
+    write_field(f, "deps", pkg->deps);
+    write_field(f, "not_deps", pkg->not_deps);
+    write_field(f, "replaces", pkg->replaces);
+    write_field(f, "provides", pkg->provides);
+
+    if (pkg->last_modified != 0) {
+        fprintf(f, "last_modified = %lu\n", (unsigned long)pkg->last_modified);
+    }
+
+    write_field(f, "sha256", pkg->sha256);
+
+    if (pkg->size != 0) {
+        fprintf(f, "size = %llu\n", (unsigned long long)pkg->size);
+    }
+
+    fprintf(f, "\n");
+}
+
+/*
+ * Atomically rewrite the shard at path with only the winning section of every
+ * package, in order of first appearance.
+ *
+ * @return nonzero on error, *compacted is set if the shard was rewritten.
+ */
+/*
+ * The shard at path must still be the file open as mapped_fd, or vpkg-sync
+ * replaced it after it was parsed.
+ */
+static bool shard_unchanged(const std::string &path, int mapped_fd)
+{
+    struct stat a, b;
+
+    if (fstat(mapped_fd, &a) < 0 || stat(path.c_str(), &b) < 0) {
+        return false;
+    }
+
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+/*
+ * The caller holds the lock of the config directory, which vpkg-sync also
+ * takes to replace shards.
+ */
+static int compact_shard(const std::string &path, int mapped_fd, const std::vector<config_chunk> &chunks, size_t shard,
+                         bool *compacted)
+{
+    vpkg::packages packages;
+    size_t total = 0;
+    char *tmp_path;
+    FILE *f;
+    int fd;
+
+    *compacted = false;
+
+    for (const config_chunk &chunk : chunks) {
+        if (chunk.shard != shard) {
+            continue;
+        }
+
+        for (const config_section &sec : chunk.sections) {
+            if (apply_section(&packages, &sec) != 0) {
+                return -1;
+            }
+        }
+
+        total += chunk.sections.size();
+    }
+
+    if (total == packages.size()) {
+        return 0;
+    }
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", path.c_str()) < 0) {
+        return -1;
+    }
+
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        free_preserve_errno(tmp_path);
+        return -1;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        goto out_unlink;
+    }
+
+    for (auto it = packages.begin(); it != packages.end(); ++it) {
+        write_package(f, it->first, &it->second);
+    }
+
+    if (ferror(f) || fchmod(fileno(f), 0644) < 0) {
+        fclose(f);
+        goto out_unlink;
+    }
+
+    if (fclose(f) != 0) {
+        goto out_unlink;
+    }
+
+    // The new shard is compacted on the next run.
+    if (!shard_unchanged(path, mapped_fd)) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+
+    if (rename(tmp_path, path.c_str()) < 0) {
+        goto out_unlink;
+    }
+
+    free(tmp_path);
+    *compacted = true;
+    return 0;
+
+out_unlink:
+    unlink(tmp_path);
+    free_preserve_errno(tmp_path);
+    return -1;
+}
+
+static bool index_writable(const std::string &index_path)
+{
+    size_t slash = index_path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : index_path.substr(0, slash + 1);
+
+    return access(dir.c_str(), W_OK) == 0;
+}
+
+static int shard_filter(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
+
+    return d->d_name[0] != '.' && len > 4 && strcmp(d->d_name + len - 4, ".ini") == 0;
+}
+
+/*
+ * Collect the shards of a config directory, ordered by name.
+ */
+static int list_shards(const char *dir, std::vector<std::string> *paths)
+{
+    struct dirent **names;
+    int n;
+
+    n = scandir(dir, &names, shard_filter, alphasort);
+    if (n < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        paths->push_back(std::string{dir} + "/" + names[i]->d_name);
+        free(names[i]);
     }
 
+    free(names);
     return 0;
 }
 
-int ::vpkg::config_init(::vpkg::config *config, const char *config_path)
+static uint64_t fingerprint_add(uint64_t h, const void *data, size_t len)
+{
+    auto p = static_cast<const unsigned char *>(data);
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3;
+    }
+
+    return h;
+}
+
+/*
+ * Identifies the exact set and versions of the files an index is built from.
+ * Shards are replaced by rename, so their inode changes on every sync.
+ */
+static uint64_t fingerprint_file(uint64_t h, const std::string &path, const struct stat *st)
+{
+    const uint64_t fields[] = {
+        (uint64_t)st->st_dev,
+        (uint64_t)st->st_ino,
+        (uint64_t)st->st_size,
+        (uint64_t)st->st_mtim.tv_sec,
+        (uint64_t)st->st_mtim.tv_nsec,
+    };
+
+    h = fingerprint_add(h, path.c_str(), path.size() + 1);
+    return fingerprint_add(h, fields, sizeof(fields));
+}
+
+int ::vpkg::config_init(::vpkg::config *config, const char *config_path, unsigned flags)
 {
     int rc = 1;
     struct stat st;
-    void *data = NULL;
-    int fd;
+    std::vector<std::string> paths;
+    std::vector<size_t> mapped;
+    std::vector<int> fds;
+    std::string lock_path;
+    int lock_fd = -1;
+    std::vector<config_chunk> chunks;
+    std::string index_path;
+    uint64_t fingerprint = 0xcbf29ce484222325;
+    size_t total = 0;
+    bool writable;
+    long ncpus;
 
-    fd = open(config_path, O_RDONLY);
-    if (fd < 0) {
-        goto out_close;
+    if (stat(config_path, &st) < 0) {
+        return rc;
     }
 
-    if (fstat(fd, &st) < 0) {
-        goto out_close;
+    // A directory holds one shard per source, a plain file is the only shard.
+    if (S_ISDIR(st.st_mode)) {
+        if (list_shards(config_path, &paths) != 0) {
+            return rc;
+        }
+
+        index_path = std::string{config_path} + "/" + VPKG_INDEX_NAME;
+        lock_path = config_path;
+    } else {
+        const char *slash = strrchr(config_path, '/');
+
+        paths.push_back(config_path);
+        index_path = std::string{config_path} + VPKG_INDEX_SUFFIX;
+        lock_path = slash ? std::string{config_path, (size_t)(slash - config_path) + 1} : ".";
     }
 
-    if (st.st_size != 0) {
-        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (data == MAP_FAILED) {
+    for (const std::string &path : paths) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        // Shards may be removed by a concurrent sync.
+        if (fd < 0 && errno == ENOENT && paths.size() > 1) {
+            fds.push_back(-1);
+            continue;
+        }
+
+        if (fd < 0) {
             goto out_close;
         }
 
-        if (!ini_parse_string(static_cast<const char *>(data), st.st_size, cb_ini_vpkg_config, &config->packages)) {
-            errno = EINVAL;
+        fds.push_back(fd);
+
+        if (fstat(fd, &st) < 0) {
             goto out_close;
         }
+
+        fingerprint = fingerprint_file(fingerprint, path, &st);
+    }
+
+    // The compiled index is only used if it was built from these exact files.
+    if (!(flags & CONFIG_COMPACT) && index_load(config, index_path.c_str(), fingerprint) == 0) {
+        rc = 0;
+        goto out_close;
+    }
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        void *data;
+
+        if (fds[i] < 0 || fstat(fds[i], &st) < 0 || st.st_size == 0) {
+            continue;
+        }
+
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fds[i], 0);
+        if (data == MAP_FAILED) {
+            goto out_unmap;
+        }
+
+        config->mappings.push_back({data, (size_t)st.st_size});
+        mapped.push_back(i);
+        total += count_sections(static_cast<const char *>(data), st.st_size);
+    }
+
+    if (config->packages.reserve(total) != 0) {
+        goto out_unmap;
+    }
+
+    writable = !(flags & CONFIG_READONLY) && (index_writable(index_path) || (flags & CONFIG_COMPACT));
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) {
+        ncpus = 1;
+    }
+
+    // Decoding everything only pays off if the result can be saved.
+    if (!writable) {
+        for (const vpkg::config_mapping &m : config->mappings) {
+            if (scan_ini(&config->packages, static_cast<const char *>(m.mem), m.len) != 0) {
+                goto out_unmap;
+            }
+        }
+    } else {
+        for (size_t i = 0; i < config->mappings.size(); i++) {
+            const vpkg::config_mapping &m = config->mappings[i];
+            size_t nchunks = std::clamp(m.len / CONFIG_CHUNK_MIN, (size_t)1, (size_t)ncpus);
+
+            split_chunks(&chunks, i, static_cast<const char *>(m.mem), m.len, nchunks);
+        }
+
+        if (parse_ini(&config->packages, &chunks, ncpus) != 0) {
+            goto out_unmap;
+        }
+
+        // Only on request: vpkg-sync may replace a shard at any time, and a
+        // compaction of the old one must not be renamed over it. vpkg-sync
+        // takes the same lock to replace shards.
+        if (flags & CONFIG_COMPACT) {
+            std::vector<bool> compacted(paths.size());
+            bool any = false;
+
+            lock_fd = open(lock_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (lock_fd < 0 || flock(lock_fd, LOCK_EX) < 0) {
+                goto out_unmap;
+            }
+
+            for (size_t i = 0; i < mapped.size(); i++) {
+                bool c;
+
+                if (compact_shard(paths[mapped[i]], fds[mapped[i]], chunks, i, &c) != 0) {
+                    goto out_unmap;
+                }
+
+                compacted[mapped[i]] = c;
+                any |= c;
+            }
+
+            // The index has to match the compacted shards, and the others
+            // as they were read.
+            if (any) {
+                fingerprint = 0xcbf29ce484222325;
+
+                for (size_t i = 0; i < paths.size(); i++) {
+                    if (fds[i] < 0) {
+                        continue;
+                    }
+
+                    if ((compacted[i] ? stat(paths[i].c_str(), &st) : fstat(fds[i], &st)) == 0) {
+                        fingerprint = fingerprint_file(fingerprint, paths[i], &st);
+                    }
+                }
+            }
+        }
+    }
+
+    if (compute_version_keys(&config->packages) != 0) {
+        goto out_unmap;
     }
 
-    config->mem = data;
-    config->len = st.st_size;
     rc = 0;
 
+    if (writable) {
+        index_write(config, index_path.c_str(), fingerprint);
+    }
+
+    goto out_close;
+
+out_unmap:
+    config_fini(config);
+    config->mappings.clear();
+
 out_close:
-    close(fd);
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    if (lock_fd >= 0) {
+        close(lock_fd);
+    }
+
     return rc;
 }
 
 void ::vpkg::config_fini(::vpkg::config *config)
 {
-    if (config->len) {
-        munmap(config->mem, config->len);
+    for (const vpkg::config_mapping &m : config->mappings) {
+        munmap(m.mem, m.len);
     }
 }
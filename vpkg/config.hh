@@ -3,31 +3,39 @@
 
 #include <string_view>
 #include <string>
-#include <map>
+#include <vector>
 
 #include <stddef.h>
 #include <xbps.h>
 
 #include "defs.h"
 
+#include "vpkg/packages.hh"
+
 namespace vpkg {
-struct package {
-    std::string_view url{};
-    std::string_view deps{};
-    std::string_view provides{};
-    std::string_view replaces{};
-    std::string_view version{};
-    std::string_view not_deps{};
-    time_t last_modified{0};
-};
+struct index_header;
 
-using packages = std::map<std::string_view, vpkg::package>;
+struct config_mapping {
+    void *mem;
+    size_t len;
+};
 
 struct config {
     ::vpkg::packages packages;
 
-    void *mem;
-    size_t len;
+    // The files packages point into, either the ini shards or the index.
+    std::vector<::vpkg::config_mapping> mappings;
+
+    // The compiled index, if the packages were loaded from it.
+    const ::vpkg::index_header *index{nullptr};
+};
+
+enum config_flags {
+    // Rewrite shards that have dead sections without them.
+    CONFIG_COMPACT = 1 << 0,
+
+    // Write nothing, neither the index nor shards.
+    CONFIG_READONLY = 1 << 1,
 };
 
 /*!
@@ -36,9 +44,23 @@ struct config {
  * lifetime of config entries must not exceed the lifetime of this string.
  * @param[in] len The length of the str argument
  *
+ * config_path is either a single ini file or a directory of ini shards, one
+ * per source. Shards are loaded concurrently and in name order, duplicate
+ * packages across shards are resolved by version.
+ *
+ * If a compiled index (config_path + VPKG_INDEX_SUFFIX, or VPKG_INDEX_NAME
+ * inside the directory) built from the current version of the files exists,
+ * it is mapped instead of parsing the ini. Otherwise the ini is parsed and the
+ * index is rewritten, if possible.
+ *
+ * With CONFIG_COMPACT, shards with duplicate sections that lost against
+ * another section are rewritten atomically with only the winning sections.
+ * Shards are never rewritten otherwise, as vpkg-sync may be replacing them.
+ * CONFIG_READONLY overrides both, nothing is written at all.
+ *
  * @return nonzero if any error occurred, the exact value is currently undefined.
  */
-int config_init(::vpkg::config *config, const char *config_path);
+int config_init(::vpkg::config *config, const char *config_path, unsigned flags = 0);
 void config_fini(::vpkg::config *config);
 }
 
@@ -0,0 +1,1007 @@
+#include "vpkg/convert.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <elf.h>
+
+#include <filesystem>
+#include <algorithm>
+#include <utility>
+#include <tuple>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <xbps.h>
+
+#include "defs.h"
+
+#include "vpkg/util.hh"
+
+#define CONVERT_BLOCK (1 << 16)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CONVERT_ELFDATA ELFDATA2LSB
+#else
+#define CONVERT_ELFDATA ELFDATA2MSB
+#endif
+
+// Directories that are merged into /usr on Void, longer prefixes first.
+static const std::pair<std::string_view, std::string_view> convert_moves[] = {
+    {"usr/sbin", "usr/bin"},
+    {"usr/lib64", "usr/lib"},
+    {"sbin", "usr/bin"},
+    {"bin", "usr/bin"},
+    {"lib64", "usr/lib"},
+    {"lib32", "usr/lib32"},
+    {"lib", "usr/lib"},
+};
+
+struct convert_entry {
+    std::string source;
+    struct stat st;
+
+    // Of links.
+    std::string target;
+
+    // Of files.
+    char sha256[VPKG_SHA256_HEX_SIZE];
+};
+
+struct convert_writer {
+    int fd;
+    ::vpkg::sha256 sha;
+};
+
+// Entries by their path in the package, without the leading slash.
+using convert_entries = std::map<std::string, convert_entry>;
+
+static int convert_fail(::vpkg::conversion *conversion, std::string_view what, const char *why)
+{
+    conversion->error = std::string{what} + ": " + why;
+    return -1;
+}
+
+static std::vector<std::string_view> convert_split(std::string_view s)
+{
+    std::vector<std::string_view> words;
+
+    while (!s.empty()) {
+        size_t start = s.find_first_not_of(" \t\n");
+        if (start == std::string_view::npos) {
+            break;
+        }
+
+        s = s.substr(start);
+        size_t end = std::min(s.find_first_of(" \t\n"), s.size());
+        words.push_back(s.substr(0, end));
+        s = s.substr(end);
+    }
+
+    return words;
+}
+
+/*
+ * Move path into /usr like xdeb. Sets merged if path is one of the merged
+ * directories itself, only a directory may take its place.
+ */
+static std::string convert_move(std::string_view path, bool *merged)
+{
+    *merged = false;
+
+    for (auto &[from, to] : convert_moves) {
+        if (path.starts_with(from) && (path.size() == from.size() || path[from.size()] == '/')) {
+            *merged = path.size() == from.size();
+            return std::string{to} + std::string{path.substr(from.size())};
+        }
+    }
+
+    *merged = path == "usr/bin" || path == "usr/lib" || path == "usr/lib32";
+    return std::string{path};
+}
+
+/*
+ * Read the fields of the deb822 file at path, continuation lines are joined
+ * with newlines.
+ */
+static int convert_fields(const std::string &path, std::map<std::string, std::string, std::less<>> *fields)
+{
+    std::string *field = NULL;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path.c_str(), "re");
+    if (f == NULL) {
+        return -1;
+    }
+
+    while ((len = getline(&line, &size, f)) > 0) {
+        std::string_view view{line, (size_t)len};
+
+        while (!view.empty() && (view.back() == '\n' || view.back() == '\r')) {
+            view.remove_suffix(1);
+        }
+
+        if (view.empty()) {
+            field = NULL;
+        } else if (view[0] == ' ' || view[0] == '\t') {
+            if (field != NULL) {
+                field->push_back('\n');
+                field->append(view.substr(1));
+            }
+        } else if (size_t colon = view.find(':'); colon != std::string_view::npos) {
+            std::string_view value = view.substr(colon + 1);
+            value.remove_prefix(std::min(value.find_first_not_of(" \t"), value.size()));
+
+            field = &(*fields)[std::string{view.substr(0, colon)}];
+            *field = value;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+/*
+ * The continuation lines of a Description, lines of a single dot separate
+ * its paragraphs.
+ */
+static std::string convert_long_desc(std::string_view lines)
+{
+    std::string long_desc;
+
+    while (!lines.empty()) {
+        size_t end = std::min(lines.find('\n'), lines.size());
+        std::string_view line = lines.substr(0, end);
+
+        if (!long_desc.empty()) {
+            long_desc.push_back('\n');
+        }
+
+        long_desc.append(line == "." ? "" : line);
+        lines = lines.substr(std::min(end + 1, lines.size()));
+    }
+
+    return long_desc;
+}
+
+/*
+ * Collect the files of entries the deb lists as conffiles, the list is
+ * optional.
+ */
+static int convert_conf_files(::vpkg::conversion *conversion, const char *datadir, const convert_entries &entries, std::set<std::string> *conf_files)
+{
+    std::string path = std::string{datadir} + "/conffiles";
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path.c_str(), "re");
+    if (f == NULL) {
+        return errno == ENOENT ? 0 : convert_fail(conversion, path, strerror(errno));
+    }
+
+    // One absolute path per line, spaces included. Lines with a flag before
+    // the path, like remove-on-upgrade, name files the deb doesn't ship.
+    while ((len = getline(&line, &size, f)) > 0) {
+        std::string_view conffile{line, (size_t)len};
+        bool merged;
+
+        if (conffile.back() == '\n') {
+            conffile.remove_suffix(1);
+        }
+
+        if (conffile.empty() || conffile[0] != '/') {
+            continue;
+        }
+
+        conffile.remove_prefix(std::min(conffile.find_first_not_of('/'), conffile.size()));
+        std::string moved = convert_move(conffile, &merged);
+
+        auto it = entries.find(moved);
+        if (it != entries.end() && S_ISREG(it->second.st.st_mode)) {
+            conf_files->insert(moved);
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+template <typename Ehdr, typename Phdr, typename Dyn>
+static void convert_elf(const unsigned char *data, size_t size, std::set<std::string> *needed, std::set<std::string> *sonames)
+{
+    std::vector<uint64_t> needed_offsets;
+    uint64_t soname = UINT64_MAX;
+    uint64_t strtab = 0, strsz = 0, stroff = UINT64_MAX;
+    std::vector<Phdr> phdrs;
+    Ehdr ehdr;
+    Phdr dynamic{};
+
+    memcpy(&ehdr, data, sizeof(ehdr));
+
+    if (ehdr.e_phentsize != sizeof(Phdr) || ehdr.e_phoff > size || (size - ehdr.e_phoff) / sizeof(Phdr) < ehdr.e_phnum) {
+        return;
+    }
+
+    phdrs.resize(ehdr.e_phnum);
+    memcpy(phdrs.data(), data + ehdr.e_phoff, ehdr.e_phnum * sizeof(Phdr));
+
+    for (const Phdr &phdr : phdrs) {
+        if (phdr.p_type == PT_DYNAMIC) {
+            dynamic = phdr;
+        }
+    }
+
+    if (dynamic.p_type != PT_DYNAMIC || dynamic.p_offset > size || size - dynamic.p_offset < dynamic.p_filesz) {
+        return;
+    }
+
+    for (size_t i = 0; i < dynamic.p_filesz / sizeof(Dyn); i++) {
+        Dyn dyn;
+        memcpy(&dyn, data + dynamic.p_offset + i * sizeof(Dyn), sizeof(dyn));
+
+        if (dyn.d_tag == DT_NULL) {
+            break;
+        } else if (dyn.d_tag == DT_NEEDED) {
+            needed_offsets.push_back(dyn.d_un.d_val);
+        } else if (dyn.d_tag == DT_SONAME) {
+            soname = dyn.d_un.d_val;
+        } else if (dyn.d_tag == DT_STRTAB) {
+            strtab = dyn.d_un.d_ptr;
+        } else if (dyn.d_tag == DT_STRSZ) {
+            strsz = dyn.d_un.d_val;
+        }
+    }
+
+    // The string table is given by its address once loaded.
+    for (const Phdr &phdr : phdrs) {
+        if (phdr.p_type == PT_LOAD && phdr.p_vaddr <= strtab && strtab - phdr.p_vaddr < phdr.p_filesz) {
+            stroff = strtab - phdr.p_vaddr + phdr.p_offset;
+            break;
+        }
+    }
+
+    if (stroff >= size || size - stroff < strsz) {
+        return;
+    }
+
+    auto string = [&](uint64_t offset) {
+        const char *s = (const char *)data + stroff + offset;
+        return std::string{s, strnlen(s, strsz - offset)};
+    };
+
+    for (uint64_t offset : needed_offsets) {
+        if (offset < strsz) {
+            needed->insert(string(offset));
+        }
+    }
+
+    if (soname < strsz) {
+        sonames->insert(string(soname));
+    }
+}
+
+/*
+ * Hash the file of entry and collect the libraries it needs and provides,
+ * if it is a shared object or executable.
+ */
+static int convert_scan(convert_entry *entry, std::set<std::string> *needed, std::set<std::string> *sonames)
+{
+    ::vpkg::sha256 sha;
+    size_t size = entry->st.st_size;
+    unsigned char *data = NULL;
+    int rv = -1;
+    int fd;
+
+    fd = open(entry->source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (size > 0) {
+        data = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (::vpkg::sha256_init(&sha) != 0) {
+        goto out_unmap;
+    }
+
+    if (::vpkg::sha256_update(&sha, data, size) != 0 || ::vpkg::sha256_final(&sha, entry->sha256) != 0) {
+        goto out_sha;
+    }
+
+    if (size >= EI_NIDENT && memcmp(data, ELFMAG, SELFMAG) == 0 && data[EI_DATA] == CONVERT_ELFDATA) {
+        if (data[EI_CLASS] == ELFCLASS64 && size >= sizeof(Elf64_Ehdr)) {
+            convert_elf<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(data, size, needed, sonames);
+        } else if (data[EI_CLASS] == ELFCLASS32 && size >= sizeof(Elf32_Ehdr)) {
+            convert_elf<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(data, size, needed, sonames);
+        }
+    }
+
+    rv = 0;
+
+out_sha:
+    ::vpkg::sha256_fini(&sha);
+out_unmap:
+    if (data != NULL) {
+        munmap(data, size);
+    }
+
+    close(fd);
+    return rv;
+}
+
+/*
+ * Collect the contents of destdir, moved into /usr. Where two entries end up
+ * at the same path a directory wins over a link to itself, then the entry
+ * that already was at that path, then the first source path by name, so the
+ * result does not depend on the order of readdir. Directories without files
+ * or links in them are left out.
+ */
+static int convert_walk(::vpkg::conversion *conversion, const char *destdir, convert_entries *entries)
+{
+    std::string base{destdir};
+    std::vector<std::pair<std::string, convert_entry>> found;
+    std::set<std::string> used;
+    std::error_code ec;
+
+    for (std::filesystem::recursive_directory_iterator it{base, ec}, end; !ec && it != end; it.increment(ec)) {
+        convert_entry entry;
+        bool merged;
+
+        entry.source = it->path().string();
+        std::string path = convert_move(std::string_view{entry.source}.substr(base.size() + 1), &merged);
+
+        if (lstat(entry.source.c_str(), &entry.st) < 0) {
+            return convert_fail(conversion, entry.source, strerror(errno));
+        }
+
+        if (S_ISLNK(entry.st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(entry.source.c_str(), target, sizeof(target));
+
+            if (len < 0) {
+                return convert_fail(conversion, entry.source, strerror(errno));
+            }
+
+            entry.target.assign(target, len);
+        } else if (!S_ISREG(entry.st.st_mode) && !S_ISDIR(entry.st.st_mode)) {
+            continue;
+        }
+
+        if (merged && !S_ISDIR(entry.st.st_mode)) {
+            continue;
+        }
+
+        found.emplace_back(std::move(path), std::move(entry));
+    }
+
+    if (ec) {
+        return convert_fail(conversion, base, ec.message().c_str());
+    }
+
+    auto rank = [&](const std::pair<std::string, convert_entry> &item) {
+        bool moved = std::string_view{item.second.source}.substr(base.size() + 1) != item.first;
+
+        return std::tuple{std::string_view{item.first}, !S_ISDIR(item.second.st.st_mode), moved, std::string_view{item.second.source}};
+    };
+
+    std::sort(found.begin(), found.end(), [&](const auto &a, const auto &b) {
+        return rank(a) < rank(b);
+    });
+
+    for (auto &[path, entry] : found) {
+        entries->try_emplace(std::move(path), std::move(entry));
+    }
+
+    for (const auto &[path, entry] : *entries) {
+        if (S_ISDIR(entry.st.st_mode)) {
+            continue;
+        }
+
+        for (size_t slash = path.rfind('/'); slash != std::string::npos && slash > 0; slash = path.rfind('/', slash - 1)) {
+            if (!used.insert(path.substr(0, slash)).second) {
+                break;
+            }
+        }
+    }
+
+    std::erase_if(*entries, [&](const auto &item) {
+        return S_ISDIR(item.second.st.st_mode) && !used.contains(item.first);
+    });
+
+    return 0;
+}
+
+/*
+ * Resolve the sonames needed but not provided by the package to the packages
+ * providing them, besides the dependencies given by its source.
+ */
+static xbps_array_t convert_run_depends(::vpkg::conversion *conversion, const std::set<std::string> &needed, const std::set<std::string> &sonames)
+{
+    std::vector<std::string_view> not_deps = convert_split(conversion->pkg->not_deps);
+    std::set<std::string, std::less<>> names;
+    xbps_array_t run_depends;
+
+    run_depends = xbps_array_create();
+    if (run_depends == NULL) {
+        return NULL;
+    }
+
+    for (std::string_view dep : convert_split(conversion->pkg->deps)) {
+        std::string pattern{dep};
+        char name[pattern.size() + 1];
+
+        if (xbps_pkgpattern_name(name, sizeof(name), pattern.c_str())) {
+            names.insert(name);
+        }
+
+        if (!xbps_array_add_cstring(run_depends, pattern.c_str())) {
+            goto err;
+        }
+    }
+
+    for (const std::string &soname : needed) {
+        if (sonames.contains(soname)) {
+            continue;
+        }
+
+        auto it = conversion->shlibs->pkgvers.find(soname);
+        if (it == conversion->shlibs->pkgvers.end()) {
+            continue;
+        }
+
+        std::string_view pkgver = it->second;
+        size_t dash = pkgver.rfind('-');
+        if (dash == std::string_view::npos || dash == 0) {
+            continue;
+        }
+
+        std::string_view name = pkgver.substr(0, dash);
+        if (name == conversion->name || names.contains(name) || std::find(not_deps.begin(), not_deps.end(), name) != not_deps.end()) {
+            continue;
+        }
+
+        names.emplace(name);
+
+        std::string pattern = std::string{name} + ">=" + std::string{pkgver.substr(dash + 1)};
+        if (!xbps_array_add_cstring(run_depends, pattern.c_str())) {
+            goto err;
+        }
+    }
+
+    return run_depends;
+
+err:
+    xbps_object_release(run_depends);
+    return NULL;
+}
+
+static bool convert_set_words(xbps_dictionary_t dict, const char *key, std::string_view words)
+{
+    xbps_array_t array;
+    bool ok = true;
+
+    if (convert_split(words).empty()) {
+        return true;
+    }
+
+    array = xbps_array_create();
+    if (array == NULL) {
+        return false;
+    }
+
+    for (std::string_view word : convert_split(words)) {
+        ok = ok && xbps_array_add_cstring(array, std::string{word}.c_str());
+    }
+
+    ok = ok && xbps_dictionary_set(dict, key, array);
+    xbps_object_release(array);
+    return ok;
+}
+
+/*
+ * Set key to the absolute paths of the data.tar paths, which may contain
+ * whitespace and so can't go through convert_set_words.
+ */
+static bool convert_set_paths(xbps_dictionary_t dict, const char *key, const std::set<std::string> &paths)
+{
+    xbps_array_t array;
+    bool ok = true;
+
+    if (paths.empty()) {
+        return true;
+    }
+
+    array = xbps_array_create();
+    if (array == NULL) {
+        return false;
+    }
+
+    for (const std::string &path : paths) {
+        ok = ok && xbps_array_add_cstring(array, ("/" + path).c_str());
+    }
+
+    ok = ok && xbps_dictionary_set(dict, key, array);
+    xbps_object_release(array);
+    return ok;
+}
+
+/*
+ * Describe entries in the layout of xbps-create, conf_files are listed apart
+ * from the other files.
+ */
+static xbps_dictionary_t convert_files(const convert_entries &entries, const std::set<std::string> &conf_files)
+{
+    xbps_array_t files, links, dirs, confs;
+    xbps_dictionary_t filesd;
+    bool ok;
+
+    filesd = xbps_dictionary_create();
+    files = xbps_array_create();
+    links = xbps_array_create();
+    dirs = xbps_array_create();
+    confs = xbps_array_create();
+    ok = filesd != NULL && files != NULL && links != NULL && dirs != NULL && confs != NULL;
+
+    for (const auto &[path, entry] : entries) {
+        xbps_dictionary_t d;
+        xbps_array_t array;
+
+        if (!ok) {
+            break;
+        }
+
+        d = xbps_dictionary_create();
+        if (d == NULL) {
+            ok = false;
+            break;
+        }
+
+        ok = xbps_dictionary_set_cstring(d, "file", ("/" + path).c_str());
+
+        if (S_ISDIR(entry.st.st_mode)) {
+            array = dirs;
+        } else if (S_ISLNK(entry.st.st_mode)) {
+            array = links;
+            ok = ok && xbps_dictionary_set_cstring(d, "target", entry.target.c_str());
+            ok = ok && xbps_dictionary_set_uint64(d, "mtime", entry.st.st_mtime);
+        } else {
+            array = conf_files.contains(path) ? confs : files;
+            ok = ok && xbps_dictionary_set_cstring(d, "sha256", entry.sha256);
+            ok = ok && xbps_dictionary_set_uint64(d, "size", entry.st.st_size);
+            ok = ok && xbps_dictionary_set_uint64(d, "mtime", entry.st.st_mtime);
+        }
+
+        ok = ok && xbps_array_add(array, d);
+        xbps_object_release(d);
+    }
+
+    if (ok && xbps_array_count(files) > 0) {
+        ok = xbps_dictionary_set(filesd, "files", files);
+    }
+
+    if (ok && xbps_array_count(links) > 0) {
+        ok = xbps_dictionary_set(filesd, "links", links);
+    }
+
+    if (ok && xbps_array_count(dirs) > 0) {
+        ok = xbps_dictionary_set(filesd, "dirs", dirs);
+    }
+
+    if (ok && xbps_array_count(confs) > 0) {
+        ok = xbps_dictionary_set(filesd, "conf_files", confs);
+    }
+
+    if (files != NULL) {
+        xbps_object_release(files);
+    }
+
+    if (links != NULL) {
+        xbps_object_release(links);
+    }
+
+    if (dirs != NULL) {
+        xbps_object_release(dirs);
+    }
+
+    if (confs != NULL) {
+        xbps_object_release(confs);
+    }
+
+    if (!ok && filesd != NULL) {
+        xbps_object_release(filesd);
+        filesd = NULL;
+    }
+
+    return filesd;
+}
+
+static int convert_append_plist(struct archive *a, const char *name, xbps_dictionary_t dict)
+{
+    char *buf;
+    int r;
+
+    errno = 0;
+    buf = xbps_dictionary_externalize(dict);
+    if (buf == NULL) {
+        return errno ? -errno : -EINVAL;
+    }
+
+    r = xbps_archive_append_buf(a, buf, strlen(buf), name, 0644, "root", "root");
+    free(buf);
+    return r;
+}
+
+static la_ssize_t convert_write(struct archive *a, void *writer_, const void *buf, size_t len)
+{
+    convert_writer *writer = static_cast<convert_writer *>(writer_);
+    const char *p = static_cast<const char *>(buf);
+    size_t left = len;
+
+    while (left > 0) {
+        ssize_t n = RETRY_EINTR(write(writer->fd, p, left));
+        if (n < 0) {
+            archive_set_error(a, errno, "%s", strerror(errno));
+            return -1;
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    if (::vpkg::sha256_update(&writer->sha, buf, len) != 0) {
+        archive_set_error(a, errno, "%s", strerror(errno));
+        return -1;
+    }
+
+    return len;
+}
+
+static int convert_copy(struct archive *a, const convert_entry &entry)
+{
+    char buf[CONVERT_BLOCK];
+    ssize_t n;
+    int fd;
+
+    fd = open(entry.source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    while ((n = RETRY_EINTR(read(fd, buf, sizeof(buf)))) > 0) {
+        if (archive_write_data(a, buf, n) != n) {
+            errno = archive_errno(a) ? archive_errno(a) : EIO;
+            n = -1;
+            break;
+        }
+    }
+
+    if (n < 0) {
+        int eno = errno;
+        close(fd);
+        errno = eno;
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Write the plists and entries as a zstd compressed tar, like xbps-create.
+ * Files only appear once, further hardlinks to them are stored as such.
+ */
+static int convert_archive(::vpkg::conversion *conversion, convert_writer *writer, xbps_dictionary_t props, xbps_dictionary_t filesd, const convert_entries &entries)
+{
+    struct archive_entry_linkresolver *resolver;
+    struct archive *a;
+    int rv = -1;
+    int r;
+
+    a = archive_write_new();
+    if (a == NULL) {
+        return convert_fail(conversion, "failed to create binpkg", strerror(ENOMEM));
+    }
+
+    resolver = archive_entry_linkresolver_new();
+    if (resolver == NULL) {
+        archive_write_free(a);
+        return convert_fail(conversion, "failed to create binpkg", strerror(ENOMEM));
+    }
+
+    archive_write_set_format_pax_restricted(a);
+    archive_write_add_filter_zstd(a);
+    archive_write_set_bytes_in_last_block(a, 1);
+    archive_entry_linkresolver_set_strategy(resolver, archive_format(a));
+
+    if (conversion->threads > 0) {
+        char threads[16];
+        snprintf(threads, sizeof(threads), "%d", conversion->threads);
+
+        // Older libarchive lacks the option and compresses in this thread.
+        archive_write_set_filter_option(a, "zstd", "threads", threads);
+    }
+
+    if (archive_write_open(a, writer, NULL, convert_write, NULL) != ARCHIVE_OK) {
+        convert_fail(conversion, "failed to create binpkg", archive_error_string(a));
+        goto out;
+    }
+
+    if ((r = convert_append_plist(a, "./props.plist", props)) != 0 || (r = convert_append_plist(a, "./files.plist", filesd)) != 0) {
+        convert_fail(conversion, "failed to write plists", strerror(-r));
+        goto out;
+    }
+
+    for (const auto &[path, entry] : entries) {
+        struct archive_entry *ae, *spare = NULL;
+        std::string pathname = "./" + path;
+
+        ae = archive_entry_new();
+        if (ae == NULL) {
+            convert_fail(conversion, "failed to create binpkg", strerror(ENOMEM));
+            goto out;
+        }
+
+        archive_entry_copy_stat(ae, &entry.st);
+        archive_entry_set_pathname(ae, pathname.c_str());
+        archive_entry_set_uid(ae, 0);
+        archive_entry_set_gid(ae, 0);
+        archive_entry_set_uname(ae, "root");
+        archive_entry_set_gname(ae, "root");
+
+        if (S_ISLNK(entry.st.st_mode)) {
+            archive_entry_set_symlink(ae, entry.target.c_str());
+        }
+
+        // Tar never defers entries, spare stays NULL.
+        archive_entry_linkify(resolver, &ae, &spare);
+
+        if (archive_write_header(a, ae) != ARCHIVE_OK) {
+            convert_fail(conversion, path, archive_error_string(a));
+            archive_entry_free(ae);
+            goto out;
+        }
+
+        if (S_ISREG(entry.st.st_mode) && archive_entry_hardlink(ae) == NULL && entry.st.st_size > 0 && convert_copy(a, entry) != 0) {
+            convert_fail(conversion, path, strerror(errno));
+            archive_entry_free(ae);
+            goto out;
+        }
+
+        archive_entry_free(ae);
+    }
+
+    if (archive_write_close(a) != ARCHIVE_OK) {
+        convert_fail(conversion, "failed to write binpkg", archive_error_string(a));
+        goto out;
+    }
+
+    rv = 0;
+
+out:
+    archive_entry_linkresolver_free(resolver);
+    archive_write_free(a);
+    return rv;
+}
+
+/*
+ * Write the binpkg under a temporary name and move it in place once it is
+ * complete.
+ */
+static int convert_binpkg(::vpkg::conversion *conversion, xbps_dictionary_t props, xbps_dictionary_t filesd, const convert_entries &entries, const std::string &path)
+{
+    std::string tmp_path = path + ".XXXXXX";
+    convert_writer writer;
+
+    writer.fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+    if (writer.fd < 0) {
+        return convert_fail(conversion, path, strerror(errno));
+    }
+
+    if (::vpkg::sha256_init(&writer.sha) != 0) {
+        convert_fail(conversion, "failed to hash binpkg", strerror(errno));
+        goto out_close;
+    }
+
+    if (convert_archive(conversion, &writer, props, filesd, entries) != 0) {
+        goto out_sha;
+    }
+
+    if (::vpkg::sha256_final(&writer.sha, conversion->sha256) != 0) {
+        convert_fail(conversion, "failed to hash binpkg", strerror(errno));
+        goto out_sha;
+    }
+
+    if (fchmod(writer.fd, 0644) < 0 || close(writer.fd) < 0) {
+        convert_fail(conversion, tmp_path, strerror(errno));
+        ::vpkg::sha256_fini(&writer.sha);
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    ::vpkg::sha256_fini(&writer.sha);
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        convert_fail(conversion, path, strerror(errno));
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+
+    return 0;
+
+out_sha:
+    ::vpkg::sha256_fini(&writer.sha);
+out_close:
+    close(writer.fd);
+    unlink(tmp_path.c_str());
+    return -1;
+}
+
+int ::vpkg::shlibs_load(::vpkg::shlibs *shlibs, const char *path)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path, "re");
+    if (f == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    while ((len = getline(&line, &size, f)) > 0) {
+        std::vector<std::string_view> words = convert_split(std::string_view{line, (size_t)len});
+
+        if (words.size() == 2) {
+            shlibs->pkgvers.try_emplace(std::string{words[0]}, words[1]);
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+int ::vpkg::convert_deb(::vpkg::conversion *conversion, const char *datadir, const char *destdir)
+{
+    std::map<std::string, std::string, std::less<>> control;
+    std::set<std::string> needed, sonames, conf_files;
+    std::map<std::pair<dev_t, ino_t>, convert_entry *> inodes;
+    xbps_dictionary_t props, filesd;
+    xbps_array_t run_depends;
+    convert_entries entries;
+    uint64_t installed_size = 0;
+    std::string version;
+    const char *arch;
+    bool ok;
+    int rv;
+
+    if (convert_fields(std::string{datadir} + "/control", &control) != 0) {
+        return convert_fail(conversion, "failed to read control file", strerror(errno));
+    }
+
+    version = conversion->pkg->version.empty() ? control["Version"] : std::string{conversion->pkg->version};
+    if (version.empty()) {
+        conversion->error = "deb has no version";
+        return -1;
+    }
+
+    std::replace(version.begin(), version.end(), '-', '.');
+    std::replace(version.begin(), version.end(), '_', '.');
+    std::replace(version.begin(), version.end(), '/', '.');
+
+    if (convert_walk(conversion, destdir, &entries) != 0) {
+        return -1;
+    }
+
+    for (auto &[path, entry] : entries) {
+        if (S_ISLNK(entry.st.st_mode)) {
+            installed_size += entry.st.st_size;
+        }
+
+        if (!S_ISREG(entry.st.st_mode)) {
+            continue;
+        }
+
+        // Hardlinks are only read once.
+        if (entry.st.st_nlink > 1) {
+            auto [pos, inserted] = inodes.try_emplace({entry.st.st_dev, entry.st.st_ino}, &entry);
+            if (!inserted) {
+                memcpy(entry.sha256, pos->second->sha256, sizeof(entry.sha256));
+                continue;
+            }
+        }
+
+        if (convert_scan(&entry, &needed, &sonames) != 0) {
+            return convert_fail(conversion, entry.source, strerror(errno));
+        }
+
+        installed_size += entry.st.st_size;
+    }
+
+    if (convert_conf_files(conversion, datadir, entries, &conf_files) != 0) {
+        return -1;
+    }
+
+    arch = control["Architecture"] == "all" ? "noarch" : conversion->arch;
+
+    std::string name{conversion->name};
+    std::string pkgver = name + "-" + version + "_1";
+    std::string description = control["Description"];
+    size_t newline = std::min(description.find('\n'), description.size());
+    std::string short_desc = description.substr(0, newline);
+    std::string long_desc = convert_long_desc(std::string_view{description}.substr(std::min(newline + 1, description.size())));
+
+    run_depends = convert_run_depends(conversion, needed, sonames);
+    if (run_depends == NULL) {
+        return convert_fail(conversion, "failed to resolve dependencies", strerror(ENOMEM));
+    }
+
+    props = xbps_dictionary_create();
+    if (props == NULL) {
+        xbps_object_release(run_depends);
+        return convert_fail(conversion, "failed to create props.plist", strerror(ENOMEM));
+    }
+
+    ok = xbps_dictionary_set_cstring(props, "pkgname", name.c_str());
+    ok = ok && xbps_dictionary_set_cstring(props, "version", (version + "_1").c_str());
+    ok = ok && xbps_dictionary_set_cstring(props, "pkgver", pkgver.c_str());
+    ok = ok && xbps_dictionary_set_cstring(props, "architecture", arch);
+    ok = ok && xbps_dictionary_set_cstring(props, "short_desc", short_desc.empty() ? name.c_str() : short_desc.c_str());
+    ok = ok && xbps_dictionary_set_uint64(props, "installed_size", installed_size);
+    ok = ok && xbps_dictionary_set_cstring(props, "tags", "xdeb");
+    ok = ok && xbps_dictionary_set_cstring(props, "packaged-with", "vpkg-" VPKG_REVISION);
+    ok = ok && (long_desc.empty() || xbps_dictionary_set_cstring(props, "long_desc", long_desc.c_str()));
+    ok = ok && (control["Maintainer"].empty() || xbps_dictionary_set_cstring(props, "maintainer", control["Maintainer"].c_str()));
+    ok = ok && (control["Homepage"].empty() || xbps_dictionary_set_cstring(props, "homepage", control["Homepage"].c_str()));
+    ok = ok && (xbps_array_count(run_depends) == 0 || xbps_dictionary_set(props, "run_depends", run_depends));
+    ok = ok && convert_set_words(props, "provides", conversion->pkg->provides);
+    ok = ok && convert_set_words(props, "replaces", conversion->pkg->replaces);
+    ok = ok && convert_set_paths(props, "conf_files", conf_files);
+
+    xbps_object_release(run_depends);
+
+    if (!ok) {
+        xbps_object_release(props);
+        return convert_fail(conversion, "failed to create props.plist", strerror(ENOMEM));
+    }
+
+    filesd = convert_files(entries, conf_files);
+    if (filesd == NULL) {
+        xbps_object_release(props);
+        return convert_fail(conversion, "failed to create files.plist", strerror(ENOMEM));
+    }
+
+    std::string binpkg = std::string{conversion->binpkgs} + "/" + pkgver + "." + arch + ".xbps";
+    rv = convert_binpkg(conversion, props, filesd, entries, binpkg);
+
+    xbps_object_release(filesd);
+    xbps_object_release(props);
+
+    if (rv == 0) {
+        conversion->binpkg = std::move(binpkg);
+    }
+
+    return rv;
+}
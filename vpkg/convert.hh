@@ -0,0 +1,64 @@
+#ifndef VPKG_CONVERT_HH_
+#define VPKG_CONVERT_HH_
+
+#include <unordered_map>
+#include <string_view>
+#include <string>
+
+#include "vpkg/hash.hh"
+#include "vpkg/packages.hh"
+
+namespace vpkg {
+/*!
+ * The packages providing each soname, as written by vpkg-sync to
+ * VPKG_XDEB_SHLIBS: one "<soname> <pkgname>-<version>" per line.
+ */
+struct shlibs {
+    std::unordered_map<std::string, std::string> pkgvers;
+};
+
+/*!
+ * A missing file is not an error, there are no sonames to resolve then.
+ */
+int shlibs_load(::vpkg::shlibs *shlibs, const char *path);
+
+/*!
+ * Conversion of an extracted deb into a binpkg, the work of xdeb without
+ * running it: the control file gives the metadata, the libraries the files
+ * need are resolved to run_depends through shlibs, and the .xbps is written
+ * with libarchive while it is hashed.
+ *
+ * Paths are moved like xdeb does for Void, /bin and /sbin into /usr/bin,
+ * /lib and /lib64 into /usr/lib. Empty directories are left out.
+ */
+struct conversion {
+    std::string_view name;
+    const ::vpkg::package *pkg;
+    const ::vpkg::shlibs *shlibs;
+
+    // Of the repository, packages for all architectures are noarch.
+    const char *arch;
+
+    // Where the binpkg is written to.
+    const char *binpkgs;
+
+    // Compression threads, 0 compresses in the calling thread.
+    int threads;
+
+    // Set once the binpkg was written.
+    std::string binpkg;
+    char sha256[VPKG_SHA256_HEX_SIZE];
+
+    std::string error;
+};
+
+/*!
+ * Build the binpkg from the control files in datadir and the contents in
+ * destdir, as extracted by debstream.
+ *
+ * @return nonzero if it failed, conversion->error tells why.
+ */
+int convert_deb(::vpkg::conversion *conversion, const char *datadir, const char *destdir);
+}
+
+#endif // VPKG_CONVERT_HH_
@@ -0,0 +1,161 @@
+#include "vpkg/debcache.hh"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "vpkg/util.hh"
+
+struct debcache_entry {
+    std::string name;
+    struct timespec mtime;
+    uint64_t size;
+};
+
+static uint64_t debcache_hash(uint64_t h, std::string_view data)
+{
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 0x100000001b3;
+    }
+
+    // Separate the fields.
+    h ^= 0xff;
+    h *= 0x100000001b3;
+
+    return h;
+}
+
+int ::vpkg::debcache_init(::vpkg::debcache *cache, uint64_t max_size)
+{
+    cache->max_size = max_size;
+    cache->started = time(NULL);
+
+    if (mkdir(VPKG_DEBCACHE_PATH, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    if ((errno = pthread_mutex_init(&cache->lock, NULL)) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void ::vpkg::debcache_fini(::vpkg::debcache *cache)
+{
+    pthread_mutex_destroy(&cache->lock);
+}
+
+char *::vpkg::debcache_path(const ::vpkg::package *pkg)
+{
+    char last_modified[24];
+    uint64_t h = 0xcbf29ce484222325;
+    char *path;
+
+    // The same file, wherever it is downloaded from.
+    if (pkg->sha256.size()) {
+        if (asprintf(&path, "%s/%.*s.deb", VPKG_DEBCACHE_PATH, (int)pkg->sha256.size(), pkg->sha256.data()) < 0) {
+            return NULL;
+        }
+
+        return path;
+    }
+
+    snprintf(last_modified, sizeof(last_modified), "%" PRId64, (int64_t)pkg->last_modified);
+
+    h = debcache_hash(h, pkg->url);
+    h = debcache_hash(h, pkg->version);
+    h = debcache_hash(h, last_modified);
+
+    if (asprintf(&path, "%s/%016" PRIx64 ".deb", VPKG_DEBCACHE_PATH, h) < 0) {
+        return NULL;
+    }
+
+    return path;
+}
+
+bool ::vpkg::debcache_lookup(::vpkg::debcache *, const char *path)
+{
+    // Sets the mtime to now.
+    return utimensat(AT_FDCWD, path, NULL, 0) == 0;
+}
+
+/*
+ * Remove the least recently used entries until the cache fits. Entries used
+ * by this run may still be waiting for xdeb and are kept.
+ */
+static void debcache_evict(::vpkg::debcache *cache)
+{
+    std::vector<debcache_entry> entries;
+    uint64_t total = 0;
+    struct dirent *ent;
+    DIR *dir;
+
+    dir = opendir(VPKG_DEBCACHE_PATH);
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        struct stat st;
+
+        // Interrupted downloads count towards the size as well.
+        if ((len < 4 || strcmp(ent->d_name + len - 4, ".deb") != 0) &&
+            (len < 5 || strcmp(ent->d_name + len - 5, ".part") != 0)) {
+            continue;
+        }
+
+        if (fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        total += st.st_size;
+        entries.push_back(debcache_entry{ent->d_name, st.st_mtim, (uint64_t)st.st_size});
+    }
+
+    if (total > cache->max_size) {
+        std::sort(entries.begin(), entries.end(), [](const debcache_entry &a, const debcache_entry &b) {
+            return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+        });
+
+        for (const debcache_entry &entry : entries) {
+            if (total <= cache->max_size || entry.mtime.tv_sec >= cache->started) {
+                break;
+            }
+
+            if (unlinkat(dirfd(dir), entry.name.c_str(), 0) == 0) {
+                total -= entry.size;
+                unlinkat(dirfd(dir), (entry.name + ".resume").c_str(), 0);
+            }
+        }
+    }
+
+    closedir(dir);
+}
+
+int ::vpkg::debcache_insert(::vpkg::debcache *cache, const char *tmp_path, const char *path)
+{
+    if (rename(tmp_path, path) < 0) {
+        return -1;
+    }
+
+    ASSERT_NOERR(pthread_mutex_lock(&cache->lock));
+    debcache_evict(cache);
+    ASSERT_NOERR(pthread_mutex_unlock(&cache->lock));
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef VPKG_DEBCACHE_HH_
+#define VPKG_DEBCACHE_HH_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "defs.h"
+#include "vpkg/packages.hh"
+
+namespace vpkg {
+#define VPKG_DEBCACHE_PATH VPKG_BINPKGS "/debs"
+
+/*!
+ * Downloaded debs, kept across runs in VPKG_DEBCACHE_PATH as <key>.deb. The
+ * key is the sha256 published by the source of the package, or else a hash of
+ * its url, version and last_modified, so a changed package is a different
+ * entry. The mtime of an entry is the time it was last used, the least
+ * recently used entries are removed once the cache grows beyond max_size.
+ * Interrupted downloads are kept as <key>.deb.part until they are resumed or
+ * evicted.
+ */
+struct debcache {
+    uint64_t max_size;
+
+    // Entries used since then are not evicted.
+    time_t started;
+
+    pthread_mutex_t lock;
+};
+
+int debcache_init(::vpkg::debcache *cache, uint64_t max_size);
+void debcache_fini(::vpkg::debcache *cache);
+
+/*!
+ * @return the path of the entry of pkg, whether or not it exists, or NULL if
+ * out of memory. It must be freed.
+ */
+char *debcache_path(const ::vpkg::package *pkg);
+
+/*!
+ * @return true if the entry at path exists, it is marked as used.
+ */
+bool debcache_lookup(::vpkg::debcache *cache, const char *path);
+
+/*!
+ * Move the downloaded file at tmp_path to the entry at path and evict the
+ * least recently used entries if the cache became too large.
+ */
+int debcache_insert(::vpkg::debcache *cache, const char *tmp_path, const char *path);
+}
+
+#endif // VPKG_DEBCACHE_HH_
@@ -0,0 +1,378 @@
+#include "vpkg/debstream.hh"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <filesystem>
+#include <string_view>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "vpkg/util.hh"
+
+#define DEBSTREAM_BLOCK (1 << 16)
+
+// Like tar run as root, without following symlinks out of the directory.
+#define DEBSTREAM_EXTRACT_FLAGS \
+    (ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_ACL | \
+     ARCHIVE_EXTRACT_XATTR | ARCHIVE_EXTRACT_FFLAGS | ARCHIVE_EXTRACT_SECURE_SYMLINKS | ARCHIVE_EXTRACT_SECURE_NODOTDOT)
+
+struct debstream_reader {
+    ::vpkg::debstream *stream;
+    char buf[DEBSTREAM_BLOCK];
+};
+
+struct debstream_member {
+    ::vpkg::debstream *stream;
+    struct archive *deb;
+    char buf[DEBSTREAM_BLOCK];
+};
+
+/*
+ * Keep the first error, later ones only follow from it.
+ */
+static void debstream_fail(::vpkg::debstream *stream, const char *error)
+{
+    if (stream->error.empty()) {
+        stream->error = error;
+    }
+}
+
+static void debstream_error(::vpkg::debstream *stream, struct archive *a)
+{
+    const char *error = archive_error_string(a);
+    debstream_fail(stream, error && *error ? error : "failed to extract deb");
+}
+
+/*
+ * Read the next bytes of the deb, waiting for the download to write them.
+ */
+static la_ssize_t debstream_read(struct archive *a, void *reader_, const void **buf)
+{
+    debstream_reader *reader = static_cast<debstream_reader *>(reader_);
+    ::vpkg::debstream *stream = reader->stream;
+    curl_off_t consumed = stream->consumed;
+    curl_off_t n;
+    ssize_t nr;
+
+    ASSERT_NOERR(pthread_mutex_lock(&stream->lock));
+
+    while (!stream->cancelled && !stream->ended && stream->available <= consumed) {
+        ASSERT_NOERR(pthread_cond_wait(&stream->cond, &stream->lock));
+    }
+
+    n = stream->cancelled ? -1 : stream->available - consumed;
+    ASSERT_NOERR(pthread_mutex_unlock(&stream->lock));
+
+    if (n < 0) {
+        debstream_fail(stream, "download did not complete in one go");
+        archive_set_error(a, ECANCELED, "%s", stream->error.c_str());
+        return -1;
+    } else if (n == 0) {
+        return 0;
+    }
+
+    nr = RETRY_EINTR(pread(stream->fd, reader->buf, n < DEBSTREAM_BLOCK ? n : DEBSTREAM_BLOCK, consumed));
+    if (nr <= 0) {
+        debstream_fail(stream, nr < 0 ? strerror(errno) : "deb is shorter than written");
+        archive_set_error(a, EIO, "%s", stream->error.c_str());
+        return -1;
+    }
+
+    // The file may have started over while it was read.
+    ASSERT_NOERR(pthread_mutex_lock(&stream->lock));
+    n = stream->cancelled ? -1 : nr;
+    ASSERT_NOERR(pthread_mutex_unlock(&stream->lock));
+
+    if (n < 0) {
+        debstream_fail(stream, "download did not complete in one go");
+        archive_set_error(a, ECANCELED, "%s", stream->error.c_str());
+        return -1;
+    }
+
+    stream->consumed += nr;
+    *buf = reader->buf;
+    return nr;
+}
+
+/*
+ * Read the current member of the deb, for the nested tar reader.
+ */
+static la_ssize_t debstream_member_read(struct archive *a, void *member_, const void **buf)
+{
+    debstream_member *member = static_cast<debstream_member *>(member_);
+    la_ssize_t n = archive_read_data(member->deb, member->buf, sizeof(member->buf));
+
+    if (n < 0) {
+        debstream_error(member->stream, member->deb);
+        archive_set_error(a, EIO, "%s", member->stream->error.c_str());
+        return -1;
+    }
+
+    *buf = member->buf;
+    return n;
+}
+
+static int debstream_copy(::vpkg::debstream *stream, struct archive *tar, struct archive *disk)
+{
+    const void *block;
+    size_t size;
+    la_int64_t offset;
+    int rc;
+
+    while ((rc = archive_read_data_block(tar, &block, &size, &offset)) == ARCHIVE_OK) {
+        if (archive_write_data_block(disk, block, size, offset) < ARCHIVE_WARN) {
+            debstream_error(stream, disk);
+            return -1;
+        }
+    }
+
+    if (rc != ARCHIVE_EOF) {
+        debstream_error(stream, tar);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Unpack the tar in the current member of deb into dir.
+ */
+static int debstream_unpack(::vpkg::debstream *stream, struct archive *deb, const std::string &dir)
+{
+    debstream_member member;
+    struct archive_entry *entry;
+    struct archive *tar, *disk;
+    int rv = -1;
+    int rc;
+
+    member.stream = stream;
+    member.deb = deb;
+
+    tar = archive_read_new();
+    if (tar == NULL) {
+        debstream_fail(stream, strerror(ENOMEM));
+        return -1;
+    }
+
+    disk = archive_write_disk_new();
+    if (disk == NULL) {
+        debstream_fail(stream, strerror(ENOMEM));
+        goto out_tar;
+    }
+
+    archive_read_support_format_tar(tar);
+    archive_read_support_filter_all(tar);
+    archive_write_disk_set_options(disk, DEBSTREAM_EXTRACT_FLAGS);
+    archive_write_disk_set_standard_lookup(disk);
+
+    if (archive_read_open(tar, &member, NULL, debstream_member_read, NULL) != ARCHIVE_OK) {
+        debstream_error(stream, tar);
+        goto out_disk;
+    }
+
+    while ((rc = archive_read_next_header(tar, &entry)) == ARCHIVE_OK) {
+        std::string path = dir + "/" + archive_entry_pathname(entry);
+        archive_entry_set_pathname(entry, path.c_str());
+
+        if (archive_entry_hardlink(entry) != NULL) {
+            std::string target = dir + "/" + archive_entry_hardlink(entry);
+            archive_entry_set_hardlink(entry, target.c_str());
+        }
+
+        if (archive_write_header(disk, entry) < ARCHIVE_WARN) {
+            debstream_error(stream, disk);
+            goto out_disk;
+        }
+
+        if (archive_entry_size(entry) > 0 && debstream_copy(stream, tar, disk) != 0) {
+            goto out_disk;
+        }
+
+        if (archive_write_finish_entry(disk) < ARCHIVE_WARN) {
+            debstream_error(stream, disk);
+            goto out_disk;
+        }
+    }
+
+    if (rc != ARCHIVE_EOF) {
+        debstream_error(stream, tar);
+        goto out_disk;
+    }
+
+    rv = 0;
+
+out_disk:
+    // Directory permissions and times are only applied once all is written.
+    if (archive_write_free(disk) != ARCHIVE_OK && rv == 0) {
+        debstream_fail(stream, "failed to finish extraction");
+        rv = -1;
+    }
+out_tar:
+    archive_read_free(tar);
+    return rv;
+}
+
+static void *debstream_thread(void *stream_)
+{
+    ::vpkg::debstream *stream = static_cast<::vpkg::debstream *>(stream_);
+    bool control = false, data = false;
+    struct archive_entry *entry;
+    debstream_reader reader;
+    struct archive *deb;
+    int rc;
+
+    reader.stream = stream;
+
+    deb = archive_read_new();
+    if (deb == NULL) {
+        debstream_fail(stream, strerror(ENOMEM));
+        return NULL;
+    }
+
+    archive_read_support_format_ar(deb);
+
+    if (archive_read_open(deb, &reader, NULL, debstream_read, NULL) != ARCHIVE_OK) {
+        debstream_error(stream, deb);
+        goto out;
+    }
+
+    while ((rc = archive_read_next_header(deb, &entry)) == ARCHIVE_OK) {
+        std::string_view name = archive_entry_pathname(entry);
+
+        // The rest of other members is skipped by the next header.
+        if (name.starts_with("control.tar")) {
+            if (debstream_unpack(stream, deb, stream->datadir) != 0) {
+                goto out;
+            }
+
+            control = true;
+        } else if (name.starts_with("data.tar")) {
+            if (debstream_unpack(stream, deb, stream->destdir) != 0) {
+                goto out;
+            }
+
+            data = true;
+        }
+    }
+
+    if (rc != ARCHIVE_EOF) {
+        debstream_error(stream, deb);
+        goto out;
+    }
+
+    if (!control || !data) {
+        debstream_fail(stream, "not a deb");
+        goto out;
+    }
+
+    stream->rv = 0;
+
+out:
+    archive_read_free(deb);
+    return NULL;
+}
+
+static int debstream_mkdir(const std::string &dir)
+{
+    std::error_code ec;
+
+    std::filesystem::remove_all(dir, ec);
+    if (!ec) {
+        std::filesystem::create_directories(dir, ec);
+    }
+
+    if (ec) {
+        errno = ec.value();
+        return -1;
+    }
+
+    return 0;
+}
+
+int ::vpkg::debstream_start(::vpkg::debstream *stream, const char *path, curl_off_t available, const char *datadir, const char *destdir)
+{
+    stream->datadir = datadir;
+    stream->destdir = destdir;
+    stream->available = available;
+    stream->ended = false;
+    stream->cancelled = false;
+    stream->consumed = 0;
+    stream->rv = -1;
+    stream->error.clear();
+
+    if (debstream_mkdir(stream->datadir) != 0 || debstream_mkdir(stream->destdir) != 0) {
+        return -1;
+    }
+
+    stream->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (stream->fd < 0) {
+        return -1;
+    }
+
+    if ((errno = pthread_mutex_init(&stream->lock, NULL)) != 0) {
+        goto out_close;
+    }
+
+    if ((errno = pthread_cond_init(&stream->cond, NULL)) != 0) {
+        goto out_mutex;
+    }
+
+    if ((errno = pthread_create(&stream->thread, NULL, debstream_thread, stream)) != 0) {
+        goto out_cond;
+    }
+
+    return 0;
+
+out_cond:
+    pthread_cond_destroy(&stream->cond);
+out_mutex:
+    pthread_mutex_destroy(&stream->lock);
+out_close:
+    close(stream->fd);
+    return -1;
+}
+
+void ::vpkg::debstream_advance(void *stream_, curl_off_t available)
+{
+    ::vpkg::debstream *stream = static_cast<::vpkg::debstream *>(stream_);
+
+    ASSERT_NOERR(pthread_mutex_lock(&stream->lock));
+
+    // Bytes the thread may have read already are written again.
+    if (available < stream->available) {
+        stream->cancelled = true;
+    }
+
+    stream->available = available;
+
+    ASSERT_NOERR(pthread_cond_signal(&stream->cond));
+    ASSERT_NOERR(pthread_mutex_unlock(&stream->lock));
+}
+
+void ::vpkg::debstream_end(::vpkg::debstream *stream, bool complete)
+{
+    ASSERT_NOERR(pthread_mutex_lock(&stream->lock));
+
+    stream->ended = true;
+    stream->cancelled |= !complete;
+
+    ASSERT_NOERR(pthread_cond_signal(&stream->cond));
+    ASSERT_NOERR(pthread_mutex_unlock(&stream->lock));
+}
+
+int ::vpkg::debstream_wait(::vpkg::debstream *stream)
+{
+    ASSERT_NOERR(pthread_join(stream->thread, NULL));
+
+    pthread_cond_destroy(&stream->cond);
+    pthread_mutex_destroy(&stream->lock);
+    close(stream->fd);
+
+    return stream->rv;
+}
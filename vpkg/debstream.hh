@@ -0,0 +1,67 @@
+#ifndef VPKG_DEBSTREAM_HH_
+#define VPKG_DEBSTREAM_HH_
+
+#include <string>
+
+#include <curl/curl.h>
+#include <pthread.h>
+
+namespace vpkg {
+/*!
+ * Extraction of a deb while it is being downloaded. A thread follows the
+ * file as the download writes it and reads its ar members with libarchive as
+ * soon as their bytes are there: control.tar.* is unpacked into datadir and
+ * data.tar.* into destdir, so decompression overlaps the transfer. The bytes
+ * are read back while they are still in the page cache.
+ *
+ * Nothing may use the extracted files before the download was verified. The
+ * extraction is abandoned if bytes it already read are written again, for
+ * example because the download had to start over.
+ */
+struct debstream {
+    int fd;
+    pthread_t thread;
+
+    std::string datadir;
+    std::string destdir;
+
+    // Protected by lock.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    curl_off_t available;
+    bool ended;
+    bool cancelled;
+
+    // Only used by the thread until it was joined.
+    curl_off_t consumed;
+    int rv;
+    std::string error;
+};
+
+/*!
+ * Start extracting the deb at path, whose first available bytes are already
+ * written. datadir and destdir are emptied first.
+ */
+int debstream_start(::vpkg::debstream *stream, const char *path, curl_off_t available, const char *datadir, const char *destdir);
+
+/*!
+ * The first available bytes of the file are written. May be called from any
+ * thread, it never blocks for long.
+ */
+void debstream_advance(void *stream, curl_off_t available);
+
+/*!
+ * No more bytes follow. If the download is not complete the extraction is
+ * abandoned.
+ */
+void debstream_end(::vpkg::debstream *stream, bool complete);
+
+/*!
+ * Wait for the extraction to finish, debstream_end must have been called.
+ *
+ * @return nonzero if the deb was not fully extracted, stream->error tells why.
+ */
+int debstream_wait(::vpkg::debstream *stream);
+}
+
+#endif // VPKG_DEBSTREAM_HH_
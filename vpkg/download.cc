@@ -0,0 +1,1155 @@
+#include "vpkg/download.hh"
+
+#include <sys/stat.h>
+
+#include <semaphore.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "vpkg/util.hh"
+
+static void share_lock(CURL *, curl_lock_data data, curl_lock_access, void *user)
+{
+    ::vpkg::downloader *downloader = static_cast<::vpkg::downloader *>(user);
+    ASSERT_NOERR(pthread_mutex_lock(&downloader->share_locks[data]));
+}
+
+static void share_unlock(CURL *, curl_lock_data data, void *user)
+{
+    ::vpkg::downloader *downloader = static_cast<::vpkg::downloader *>(user);
+    ASSERT_NOERR(pthread_mutex_unlock(&downloader->share_locks[data]));
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Whether a transfer failed in a way that another attempt may fix: the host
+ * asked us to slow down, or there was no response and nothing was written.
+ */
+static bool transfer_retryable(CURLcode code, long status)
+{
+    switch (code) {
+    case CURLE_HTTP_RETURNED_ERROR:
+        return status == 429 || status == 502 || status == 503 || status == 504;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return status == 0;
+    default:
+        return false;
+    }
+}
+
+/*
+ * A request to host failed or was rate limited. Halve the requests in flight
+ * and pause the host for retry_after seconds if given, or an exponential
+ * backoff with jitter otherwise.
+ *
+ * @return false if the host asked for a longer pause than we are willing to
+ * wait.
+ */
+static bool host_backoff(::vpkg::downloader *downloader, ::vpkg::host_budget *host, curl_off_t retry_after)
+{
+    int64_t delay;
+
+    if (host->limit > 1) {
+        host->ceiling = host->limit;
+    }
+
+    host->limit = host->limit > 1 ? host->limit / 2 : 1;
+    host->successes = 0;
+    host->failures++;
+
+    if (retry_after > VPKG_DOWNLOAD_RETRY_AFTER_MAX) {
+        return false;
+    } else if (retry_after > 0) {
+        delay = retry_after * 1000;
+    } else {
+        int shift = host->failures - 1 < 16 ? host->failures - 1 : 16;
+        int64_t backoff = std::min((int64_t)VPKG_DOWNLOAD_BACKOFF_MS << shift, (int64_t)VPKG_DOWNLOAD_BACKOFF_MAX_MS);
+
+        // Between half and all of the backoff, so throttled clients spread out.
+        delay = backoff / 2 + rand_r(&downloader->seed) % (backoff / 2 + 1);
+    }
+
+    host->not_before = std::max(host->not_before, monotonic_ms() + delay);
+    return true;
+}
+
+static void host_success(::vpkg::host_budget *host)
+{
+    host->failures = 0;
+
+    int needed = host->limit + 1 >= host->ceiling ? 8 * host->limit : host->limit;
+
+    if (++host->successes >= needed && host->limit < VPKG_DOWNLOAD_HOST_CONNECTIONS) {
+        host->limit++;
+        host->successes = 0;
+    }
+}
+
+/*
+ * Start the waiting transfers of every host that is within its budget.
+ * Transfers curl refused are appended to failed, to be finished by the
+ * caller like any other.
+ *
+ * @return ms until a paused host with waiting transfers may continue, or -1.
+ */
+static int64_t hosts_dispatch(::vpkg::downloader *downloader, std::vector<::vpkg::transfer *> *failed)
+{
+    int64_t now = monotonic_ms();
+    int64_t wait = -1;
+
+    for (auto &[name, host] : downloader->hosts) {
+        if (host.waiting.empty()) {
+            continue;
+        }
+
+        if (host.not_before > now) {
+            wait = (wait < 0 || host.not_before - now < wait) ? host.not_before - now : wait;
+            continue;
+        }
+
+        while (!host.waiting.empty() && host.active < host.limit) {
+            ::vpkg::transfer *transfer = host.waiting.front();
+            host.waiting.pop_front();
+
+            if (curl_multi_add_handle(downloader->multi, transfer->easy) != CURLM_OK) {
+                failed->push_back(transfer);
+                continue;
+            }
+
+            host.active++;
+        }
+    }
+
+    return wait;
+}
+
+static void *downloader_thread(void *downloader_)
+{
+    ::vpkg::downloader *downloader = static_cast<::vpkg::downloader *>(downloader_);
+    std::vector<::vpkg::transfer *> pending;
+    std::vector<::vpkg::transfer *> failed;
+    // Transfers submitted and not done yet, running or waiting for their host.
+    size_t unfinished = 0;
+    int running = 0;
+    bool stop;
+
+    for (;;) {
+        ASSERT_NOERR(pthread_mutex_lock(&downloader->lock));
+        pending.swap(downloader->pending);
+        stop = downloader->stop;
+        ASSERT_NOERR(pthread_mutex_unlock(&downloader->lock));
+
+        for (::vpkg::transfer *transfer : pending) {
+            ::vpkg::host_budget &host = downloader->hosts.try_emplace(transfer->host, ::vpkg::host_budget{VPKG_DOWNLOAD_HOST_CONNECTIONS, VPKG_DOWNLOAD_HOST_CONNECTIONS + 1, 0, 0, 0, 0, {}}).first->second;
+            host.waiting.push_back(transfer);
+            unfinished++;
+        }
+
+        pending.clear();
+
+        if (stop && unfinished == 0) {
+            break;
+        }
+
+        int64_t wait = hosts_dispatch(downloader, &failed);
+
+        for (::vpkg::transfer *transfer : failed) {
+            unfinished--;
+            transfer->code = CURLE_FAILED_INIT;
+            transfer->done(transfer, transfer->code);
+        }
+
+        failed.clear();
+
+        curl_multi_perform(downloader->multi, &running);
+
+        CURLMsg *msg;
+        int left;
+
+        while ((msg = curl_multi_info_read(downloader->multi, &left)) != NULL) {
+            ::vpkg::transfer *transfer;
+            CURLcode code;
+            long status = 0;
+            curl_off_t retry_after = 0;
+
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+
+            code = msg->data.result;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RETRY_AFTER, &retry_after);
+            curl_multi_remove_handle(downloader->multi, msg->easy_handle);
+
+            ::vpkg::host_budget &host = downloader->hosts[transfer->host];
+            host.active--;
+
+            if (downloader->observe != NULL) {
+                downloader->observe(downloader->observe_user, transfer, code);
+            }
+
+            if (code == CURLE_OK) {
+                host_success(&host);
+            } else if (transfer_retryable(code, status)) {
+                // Back in front of the queue, it has waited the longest.
+                if (host_backoff(downloader, &host, retry_after) && ++transfer->attempts < transfer->max_attempts) {
+                    host.waiting.push_front(transfer);
+                    wait = 0;
+                    continue;
+                }
+            }
+
+            // Its slot may go to a waiting transfer right away.
+            wait = 0;
+            unfinished--;
+            transfer->code = code;
+            transfer->done(transfer, transfer->code);
+        }
+
+        // Let curl wait for its sockets, but not past the end of a host pause.
+        curl_multi_poll(downloader->multi, NULL, 0, (wait >= 0 && wait < 1000) ? (int)wait : 1000, NULL);
+    }
+
+    return NULL;
+}
+
+int ::vpkg::downloader_init(::vpkg::downloader *downloader)
+{
+    CURLSHcode shcode = CURLSHE_OK;
+    int i;
+
+    downloader->stop = false;
+    downloader->observe = NULL;
+    downloader->observe_user = NULL;
+    downloader->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+
+    downloader->multi = curl_multi_init();
+    if (downloader->multi == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (curl_multi_setopt(downloader->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX) != CURLM_OK ||
+        curl_multi_setopt(downloader->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)VPKG_DOWNLOAD_HOST_CONNECTIONS) != CURLM_OK) {
+        errno = EINVAL;
+        goto out_multi;
+    }
+
+    downloader->share = curl_share_init();
+    if (downloader->share == NULL) {
+        errno = ENOMEM;
+        goto out_multi;
+    }
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        if ((errno = pthread_mutex_init(&downloader->share_locks[i], NULL)) != 0) {
+            goto out_locks;
+        }
+    }
+
+    shcode = (shcode == CURLSHE_OK) ? curl_share_setopt(downloader->share, CURLSHOPT_LOCKFUNC, share_lock) : shcode;
+    shcode = (shcode == CURLSHE_OK) ? curl_share_setopt(downloader->share, CURLSHOPT_UNLOCKFUNC, share_unlock) : shcode;
+    shcode = (shcode == CURLSHE_OK) ? curl_share_setopt(downloader->share, CURLSHOPT_USERDATA, downloader) : shcode;
+    shcode = (shcode == CURLSHE_OK) ? curl_share_setopt(downloader->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) : shcode;
+    shcode = (shcode == CURLSHE_OK) ? curl_share_setopt(downloader->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) : shcode;
+    shcode = (shcode == CURLSHE_OK) ? curl_share_setopt(downloader->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) : shcode;
+
+    if (shcode != CURLSHE_OK) {
+        errno = EINVAL;
+        goto out_locks;
+    }
+
+    if ((errno = pthread_mutex_init(&downloader->lock, NULL)) != 0) {
+        goto out_locks;
+    }
+
+    if ((errno = pthread_create(&downloader->thread, NULL, downloader_thread, downloader)) != 0) {
+        goto out_lock;
+    }
+
+    return 0;
+
+out_lock:
+    pthread_mutex_destroy(&downloader->lock);
+
+out_locks:
+    while (i-- > 0) {
+        pthread_mutex_destroy(&downloader->share_locks[i]);
+    }
+
+    curl_share_cleanup(downloader->share);
+
+out_multi:
+    curl_multi_cleanup(downloader->multi);
+    return -1;
+}
+
+void ::vpkg::downloader_fini(::vpkg::downloader *downloader)
+{
+    ASSERT_NOERR(pthread_mutex_lock(&downloader->lock));
+    downloader->stop = true;
+    ASSERT_NOERR(pthread_mutex_unlock(&downloader->lock));
+
+    curl_multi_wakeup(downloader->multi);
+    ASSERT_NOERR(pthread_join(downloader->thread, NULL));
+
+    // Transfers share the connections, they are closed with the multi handle.
+    curl_multi_cleanup(downloader->multi);
+    curl_share_cleanup(downloader->share);
+
+    pthread_mutex_destroy(&downloader->lock);
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_mutex_destroy(&downloader->share_locks[i]);
+    }
+}
+
+int ::vpkg::transfer_init(::vpkg::transfer *transfer, ::vpkg::downloader *downloader, const char *url)
+{
+    CURLcode code = CURLE_OK;
+
+    transfer->done = NULL;
+    transfer->user = NULL;
+    transfer->code = CURLE_OK;
+    transfer->max_attempts = VPKG_DOWNLOAD_RETRIES;
+
+    transfer->easy = curl_easy_init();
+    if (transfer->easy == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_SHARE, downloader->share) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_PRIVATE, transfer) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_FOLLOWLOCATION, 1L) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_USERAGENT, "curl/8.8.0") : code;
+    // Rather wait for a connection that can be multiplexed than open another.
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_PIPEWAIT, 1L) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_CONNECTTIMEOUT, (long)VPKG_DOWNLOAD_CONNECT_TIMEOUT) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_LOW_SPEED_LIMIT, (long)VPKG_DOWNLOAD_STALL_SPEED) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_LOW_SPEED_TIME, (long)VPKG_DOWNLOAD_STALL_TIME) : code;
+
+    if (code != CURLE_OK || ::vpkg::transfer_set_url(transfer, url) != 0) {
+        curl_easy_cleanup(transfer->easy);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ::vpkg::transfer_set_url(::vpkg::transfer *transfer, const char *url)
+{
+    CURLU *curlu;
+    char *host = NULL;
+
+    transfer->url = url;
+    transfer->attempts = 0;
+
+    curlu = curl_url();
+    if (curlu == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // An unparsable url fails once the transfer runs, any key does.
+    if (curl_url_set(curlu, CURLUPART_URL, url, 0) == CURLUE_OK && curl_url_get(curlu, CURLUPART_HOST, &host, 0) == CURLUE_OK) {
+        transfer->host = host;
+        curl_free(host);
+    } else {
+        transfer->host.clear();
+    }
+
+    curl_url_cleanup(curlu);
+
+    if (curl_easy_setopt(transfer->easy, CURLOPT_URL, url) != CURLE_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void ::vpkg::transfer_fini(::vpkg::transfer *transfer)
+{
+    curl_easy_cleanup(transfer->easy);
+}
+
+int ::vpkg::downloader_submit(::vpkg::downloader *downloader, ::vpkg::transfer *transfer)
+{
+    ASSERT_NOERR(pthread_mutex_lock(&downloader->lock));
+    downloader->pending.push_back(transfer);
+    ASSERT_NOERR(pthread_mutex_unlock(&downloader->lock));
+
+    if (curl_multi_wakeup(downloader->multi) != CURLM_OK) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void transfer_signal(::vpkg::transfer *transfer, CURLcode)
+{
+    ASSERT_NOERR(sem_post(static_cast<sem_t *>(transfer->user)));
+}
+
+CURLcode vpkg::downloader_perform(::vpkg::downloader *downloader, ::vpkg::transfer *transfer)
+{
+    sem_t sem_done;
+
+    if (sem_init(&sem_done, 0, 0) < 0) {
+        return CURLE_FAILED_INIT;
+    }
+
+    transfer->done = transfer_signal;
+    transfer->user = &sem_done;
+
+    if (::vpkg::downloader_submit(downloader, transfer) != 0) {
+        sem_destroy(&sem_done);
+        return CURLE_FAILED_INIT;
+    }
+
+    RETRY_EINTR(sem_wait(&sem_done));
+    sem_destroy(&sem_done);
+
+    return transfer->code;
+}
+
+static void partial_save(::vpkg::partial *partial)
+{
+    FILE *f;
+
+    // Without a validator a changed file can't be told apart, don't resume.
+    if (partial->validator.empty()) {
+        unlink(partial->sidecar_path);
+        return;
+    }
+
+    f = fopen(partial->sidecar_path, "we");
+    if (f == NULL) {
+        return;
+    }
+
+    fprintf(f, "%s\n%s\n%lld\n%s\n%d\n", partial->url, partial->validator.c_str(), (long long)partial->offset,
+            partial->validator_url.c_str(), partial->preallocated);
+
+    if (fclose(f) != 0) {
+        unlink(partial->sidecar_path);
+    }
+}
+
+static void partial_load(::vpkg::partial *partial)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    long long offset;
+    struct stat st;
+    FILE *f;
+    int i;
+
+    f = fopen(partial->sidecar_path, "re");
+    if (f == NULL) {
+        return;
+    }
+
+    for (i = 0; i < 5 && (len = getline(&line, &size, f)) > 0; i++) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+
+        if (i == 0 && strcmp(line, partial->url) != 0) {
+            break;
+        } else if (i == 1) {
+            partial->validator = line;
+        } else if (i == 2) {
+            char *end;
+            offset = strtoll(line, &end, 10);
+
+            if (*end != '\0' || offset < 0 || fstat(partial->fd, &st) < 0 || st.st_size < offset) {
+                break;
+            }
+
+            // Everything written before an interruption is in the file.
+            partial->offset = st.st_size;
+        } else if (i == 3) {
+            partial->validator_url = line;
+        } else if (i == 4 && strcmp(line, "0") != 0) {
+            // Unless the file was preallocated for ranges, then its size is
+            // that of the whole file.
+            partial->offset = offset;
+        }
+    }
+
+    if (partial->offset == 0) {
+        partial->validator.clear();
+        partial->validator_url.clear();
+    } else if (partial->validator_url.empty()) {
+        partial->validator_url = partial->url;
+    }
+
+    free(line);
+    fclose(f);
+}
+
+int ::vpkg::partial_open(::vpkg::partial *partial, const char *path, const char *url)
+{
+    partial->url = url;
+    partial->mirrors = {url};
+    partial->start = 0;
+    partial->offset = 0;
+    partial->status = 0;
+    partial->range_start = -1;
+    partial->accept_ranges = false;
+    partial->headers = NULL;
+    partial->expected_size = -1;
+    partial->sha.ctx = NULL;
+    partial->hashed = 0;
+    partial->mismatch = false;
+    partial->preallocated = false;
+    partial->written = NULL;
+
+    if (asprintf(&partial->sidecar_path, "%s.resume", path) < 0) {
+        return -1;
+    }
+
+    partial->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (partial->fd < 0) {
+        free_preserve_errno(partial->sidecar_path);
+        return -1;
+    }
+
+    partial_load(partial);
+
+    if (ftruncate(partial->fd, partial->offset) < 0 || lseek(partial->fd, partial->offset, SEEK_SET) < 0) {
+        close(partial->fd);
+        free_preserve_errno(partial->sidecar_path);
+        return -1;
+    }
+
+    partial->start = partial->offset;
+    return 0;
+}
+
+int ::vpkg::partial_expect(::vpkg::partial *partial, std::string_view sha256, curl_off_t size)
+{
+    partial->expected_size = size;
+
+    // More than the whole file can't be part of it.
+    if (size >= 0 && partial->offset > size && ::vpkg::partial_reset(partial) != 0) {
+        return -1;
+    }
+
+    if (sha256.empty()) {
+        return 0;
+    }
+
+    if (::vpkg::sha256_init(&partial->sha) != 0) {
+        return -1;
+    }
+
+    // The state of the hash isn't kept across runs, resumed bytes are read
+    // back once.
+    if (::vpkg::sha256_update_fd(&partial->sha, partial->fd, 0, partial->offset) != 0) {
+        ::vpkg::sha256_fini(&partial->sha);
+        partial->sha.ctx = NULL;
+        return -1;
+    }
+
+    partial->expected_sha256 = sha256;
+    partial->hashed = partial->offset;
+    return 0;
+}
+
+/*
+ * Hash the len bytes written at offset, if they continue what was hashed so
+ * far. Bytes written out of order are hashed by partial_verify.
+ */
+static int partial_hash(::vpkg::partial *partial, const char *data, size_t len, curl_off_t offset)
+{
+    if (partial->sha.ctx == NULL || offset != partial->hashed) {
+        return 0;
+    }
+
+    if (::vpkg::sha256_update(&partial->sha, data, len) != 0) {
+        return -1;
+    }
+
+    partial->hashed += len;
+    return 0;
+}
+
+int ::vpkg::partial_verify(::vpkg::partial *partial)
+{
+    char hex[VPKG_SHA256_HEX_SIZE];
+
+    if (partial->expected_size >= 0 && partial->offset != partial->expected_size) {
+        partial->mismatch = true;
+        errno = EBADMSG;
+        return -1;
+    }
+
+    if (partial->sha.ctx == NULL) {
+        return 0;
+    }
+
+    if (::vpkg::sha256_update_fd(&partial->sha, partial->fd, partial->hashed, partial->offset - partial->hashed) != 0) {
+        return -1;
+    }
+
+    partial->hashed = partial->offset;
+
+    if (::vpkg::sha256_final(&partial->sha, hex) != 0) {
+        return -1;
+    }
+
+    if (strcasecmp(hex, partial->expected_sha256.c_str()) != 0) {
+        partial->mismatch = true;
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ::vpkg::partial_close(::vpkg::partial *partial, bool complete)
+{
+    int rv = 0;
+
+    curl_slist_free_all(partial->headers);
+
+    if (partial->sha.ctx != NULL) {
+        ::vpkg::sha256_fini(&partial->sha);
+    }
+
+    if (complete) {
+        unlink(partial->sidecar_path);
+    } else {
+        partial_save(partial);
+    }
+
+    if (close(partial->fd) < 0) {
+        rv = -1;
+    }
+
+    free_preserve_errno(partial->sidecar_path);
+    return rv;
+}
+
+int ::vpkg::partial_reset(::vpkg::partial *partial)
+{
+    partial->start = 0;
+    partial->offset = 0;
+    partial->validator.clear();
+    partial->validator_url.clear();
+    partial->hashed = 0;
+
+    unlink(partial->sidecar_path);
+
+    if (partial->sha.ctx != NULL && ::vpkg::sha256_reset(&partial->sha) != 0) {
+        return -1;
+    }
+
+    if (partial->written != NULL) {
+        partial->written(partial->written_user, 0);
+    }
+
+    if (ftruncate(partial->fd, 0) < 0 || lseek(partial->fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static size_t partial_write(char *data, size_t size, size_t nmemb, void *partial_)
+{
+    ::vpkg::partial *partial = static_cast<::vpkg::partial *>(partial_);
+    curl_off_t at = partial->offset;
+    size_t len = size * nmemb;
+    size_t done = 0;
+
+    if (partial->status != 200 && partial->status != 206) {
+        return 0;
+    }
+
+    if (partial->expected_size >= 0 && at + (curl_off_t)len > partial->expected_size) {
+        partial->mismatch = true;
+        return 0;
+    }
+
+    while (done < len) {
+        ssize_t n = write(partial->fd, data + done, len - done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return 0;
+        }
+
+        done += n;
+        partial->offset += n;
+    }
+
+    if (partial_hash(partial, data, len, at) != 0) {
+        return 0;
+    }
+
+    if (partial->written != NULL) {
+        partial->written(partial->written_user, partial->offset);
+    }
+
+    return len;
+}
+
+/*
+ * Called for every header line of every response, including redirects. Only
+ * the final response decides what is written, once its headers are complete.
+ */
+static size_t partial_header(char *data, size_t size, size_t nmemb, void *partial_)
+{
+    ::vpkg::partial *partial = static_cast<::vpkg::partial *>(partial_);
+    size_t len = size * nmemb;
+    std::string_view line(data, len);
+    std::string_view value;
+
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r' || line.back() == ' ')) {
+        line.remove_suffix(1);
+    }
+
+    if (line.starts_with("HTTP/")) {
+        size_t sp = line.find(' ');
+
+        partial->status = sp == std::string_view::npos ? 0 : atol(std::string(line.substr(sp + 1)).c_str());
+        partial->range_start = -1;
+        partial->accept_ranges = false;
+        partial->content_length = -1;
+        partial->range_total = -1;
+        partial->pending_validator.clear();
+        return len;
+    }
+
+    if (!line.empty()) {
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            return len;
+        }
+
+        value = line.substr(colon + 1);
+        while (!value.empty() && value.front() == ' ') {
+            value.remove_prefix(1);
+        }
+
+        std::string_view name = line.substr(0, colon);
+
+        if (name.size() == 4 && strncasecmp(name.data(), "etag", 4) == 0) {
+            // Weak ETags can't be used with If-Range.
+            if (!value.starts_with("W/")) {
+                partial->pending_validator = value;
+            }
+        } else if (name.size() == 13 && strncasecmp(name.data(), "last-modified", 13) == 0) {
+            if (partial->pending_validator.empty()) {
+                partial->pending_validator = value;
+            }
+        } else if (name.size() == 13 && strncasecmp(name.data(), "content-range", 13) == 0 && value.starts_with("bytes ")) {
+            size_t slash = value.find('/');
+
+            partial->range_start = atoll(std::string(value.substr(6)).c_str());
+
+            if (slash != std::string_view::npos && value.substr(slash + 1) != "*") {
+                partial->range_total = atoll(std::string(value.substr(slash + 1)).c_str());
+            }
+        } else if (name.size() == 14 && strncasecmp(name.data(), "content-length", 14) == 0) {
+            partial->content_length = atoll(std::string(value).c_str());
+        } else if (name.size() == 13 && strncasecmp(name.data(), "accept-ranges", 13) == 0) {
+            partial->accept_ranges = value == "bytes";
+        }
+
+        return len;
+    }
+
+    // End of the headers.
+    if (partial->status == 206) {
+        if (partial->range_start != partial->start) {
+            return 0;
+        }
+
+        if (partial->expected_size >= 0 && partial->range_total >= 0 && partial->range_total != partial->expected_size) {
+            partial->mismatch = true;
+            return 0;
+        }
+
+        if (!partial->pending_validator.empty() && partial->request_url == partial->validator_url) {
+            partial->validator = partial->pending_validator;
+        }
+    } else if (partial->status == 200) {
+        if (partial->expected_size >= 0 && partial->content_length >= 0 && partial->content_length != partial->expected_size) {
+            partial->mismatch = true;
+            return 0;
+        }
+
+        // The file changed or ranges are not supported, start over.
+        if (partial->start > 0 && ::vpkg::partial_reset(partial) < 0) {
+            return 0;
+        }
+
+        partial->validator = partial->pending_validator;
+        partial->validator_url = partial->request_url;
+    } else {
+        return len;
+    }
+
+    partial_save(partial);
+    return len;
+}
+
+int ::vpkg::partial_setup(::vpkg::partial *partial, ::vpkg::transfer *transfer)
+{
+    CURLcode code = CURLE_OK;
+
+    partial->status = 0;
+    partial->mismatch = false;
+    partial->request_url = transfer->url;
+
+    curl_slist_free_all(partial->headers);
+    partial->headers = NULL;
+
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_FAILONERROR, 1L) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_WRITEFUNCTION, partial_write) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_WRITEDATA, partial) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_HEADERFUNCTION, partial_header) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_HEADERDATA, partial) : code;
+
+    if (code == CURLE_OK && partial->start > 0) {
+        if (transfer->url == partial->validator_url) {
+            std::string if_range = "If-Range: " + partial->validator;
+
+            partial->headers = curl_slist_append(NULL, if_range.c_str());
+            if (partial->headers == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+
+        snprintf(partial->range, sizeof(partial->range), "%lld-", (long long)partial->start);
+
+        // CURLOPT_RESUME_FROM would fail on a 200 instead of starting over.
+        code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_RANGE, partial->range) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(transfer->easy, CURLOPT_HTTPHEADER, partial->headers) : code;
+    }
+
+    if (code != CURLE_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+curl_off_t vpkg::partial_probe(::vpkg::downloader *downloader, ::vpkg::partial *partial)
+{
+    CURLcode code = CURLE_OK;
+    ::vpkg::transfer transfer;
+    curl_off_t size = -1;
+
+    if (::vpkg::transfer_init(&transfer, downloader, partial->mirrors[0].c_str()) != 0) {
+        return -1;
+    }
+
+    code = (code == CURLE_OK) ? curl_easy_setopt(transfer.easy, CURLOPT_NOBODY, 1L) : code;
+    code = (code == CURLE_OK && ::vpkg::partial_setup(partial, &transfer) != 0) ? CURLE_FAILED_INIT : code;
+    code = (code == CURLE_OK) ? ::vpkg::downloader_perform(downloader, &transfer) : code;
+
+    if (code == CURLE_OK && partial->status == 200 && partial->accept_ranges && !partial->validator.empty()) {
+        curl_easy_getinfo(transfer.easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+    }
+
+    ::vpkg::transfer_fini(&transfer);
+    return size;
+}
+
+struct partial_segments;
+
+struct partial_segment {
+    ::vpkg::transfer transfer;
+    struct partial_segments *segments;
+
+    // Range of the file, and bytes written so far.
+    curl_off_t begin, end, now;
+    bool ranged;
+    char range[48];
+
+    // Index into the mirrors of the partial.
+    size_t mirror;
+};
+
+struct partial_segments {
+    ::vpkg::downloader *downloader;
+    ::vpkg::partial *partial;
+    struct curl_slist *headers;
+    std::vector<partial_segment> segment;
+    curl_off_t size;
+
+    curl_xferinfo_callback progress;
+    void *clientp;
+
+    sem_t sem_done;
+};
+
+/*
+ * Bytes at the start of the file that are written: the complete ranges up to
+ * the first incomplete one, and what it has so far.
+ */
+static curl_off_t segments_written(const partial_segments *segments)
+{
+    curl_off_t written = 0;
+
+    for (const partial_segment &segment : segments->segment) {
+        written = segment.begin + segment.now;
+
+        if (written != segment.end) {
+            break;
+        }
+    }
+
+    return written;
+}
+
+static size_t segment_write(char *data, size_t size, size_t nmemb, void *segment_)
+{
+    partial_segment *segment = static_cast<partial_segment *>(segment_);
+    size_t len = size * nmemb;
+    size_t done = 0;
+
+    // A 200 would write the whole file at the offset of the range.
+    if (!segment->ranged) {
+        long status = 0;
+        curl_easy_getinfo(segment->transfer.easy, CURLINFO_RESPONSE_CODE, &status);
+
+        if (status != 206) {
+            return 0;
+        }
+
+        segment->ranged = true;
+    }
+
+    if ((curl_off_t)len > segment->end - segment->begin - segment->now) {
+        return 0;
+    }
+
+    curl_off_t at = segment->begin + segment->now;
+
+    while (done < len) {
+        ssize_t n = pwrite(segment->segments->partial->fd, data + done, len - done, segment->begin + segment->now);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return 0;
+        }
+
+        done += n;
+        segment->now += n;
+    }
+
+    // Only the first range arrives in order, the others are hashed once
+    // the file is complete.
+    if (partial_hash(segment->segments->partial, data, len, at) != 0) {
+        return 0;
+    }
+
+    if (segment->segments->partial->written != NULL) {
+        segment->segments->partial->written(segment->segments->partial->written_user, segments_written(segment->segments));
+    }
+
+    return len;
+}
+
+static int segment_progress(void *segment_, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    partial_segment *segment = static_cast<partial_segment *>(segment_);
+    partial_segments *segments = segment->segments;
+    curl_off_t now = 0;
+
+    // Every transfer runs on the thread of the downloader, no lock needed.
+    for (const partial_segment &s : segments->segment) {
+        now += s.now;
+    }
+
+    return segments->progress(segments->clientp, segments->size, now, 0, 0);
+}
+
+static int segment_request(partial_segment *segment)
+{
+    partial_segments *segments = segment->segments;
+    const std::string &url = segments->partial->mirrors[segment->mirror];
+    CURLcode code = CURLE_OK;
+
+    segment->ranged = false;
+    snprintf(segment->range, sizeof(segment->range), "%lld-%lld", (long long)(segment->begin + segment->now), (long long)segment->end - 1);
+
+    if (::vpkg::transfer_set_url(&segment->transfer, url.c_str()) != 0) {
+        return -1;
+    }
+
+    code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_RANGE, segment->range) : code;
+    code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_HTTPHEADER, url == segments->partial->validator_url ? segments->headers : NULL) : code;
+
+    if (code != CURLE_OK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return ::vpkg::downloader_submit(segments->downloader, &segment->transfer);
+}
+
+static void segment_done(::vpkg::transfer *transfer, CURLcode code)
+{
+    partial_segment *segment = static_cast<partial_segment *>(transfer->user);
+
+    // The rest of a stalled or failed range is asked from the next mirror. A
+    // write error is a refused response or a full disk, which it won't fix.
+    if (code != CURLE_OK && code != CURLE_WRITE_ERROR && segment->mirror + 1 < segment->segments->partial->mirrors.size()) {
+        segment->mirror++;
+
+        if (segment_request(segment) == 0) {
+            return;
+        }
+    }
+
+    ASSERT_NOERR(sem_post(&segment->segments->sem_done));
+}
+
+CURLcode vpkg::partial_segmented(::vpkg::downloader *downloader, ::vpkg::partial *partial, curl_off_t size, int nsegments,
+                                 curl_xferinfo_callback progress, void *clientp)
+{
+    CURLcode rv = CURLE_OK;
+    partial_segments segments;
+    std::string if_range = "If-Range: " + partial->validator;
+    int i, nsubmitted = 0;
+
+    // Ranges complete out of order, a run killed before they are done must
+    // not take the allocated size as what was written.
+    partial->preallocated = true;
+    partial_save(partial);
+
+    if ((errno = posix_fallocate(partial->fd, 0, size)) != 0) {
+        return CURLE_WRITE_ERROR;
+    }
+
+    segments.headers = curl_slist_append(NULL, if_range.c_str());
+    if (segments.headers == NULL) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+
+    if (sem_init(&segments.sem_done, 0, 0) < 0) {
+        curl_slist_free_all(segments.headers);
+        return CURLE_FAILED_INIT;
+    }
+
+    segments.downloader = downloader;
+    segments.partial = partial;
+    segments.size = size;
+    segments.progress = progress;
+    segments.clientp = clientp;
+    segments.segment.resize(nsegments);
+
+    // Every range is set before the first transfer looks at the others.
+    for (i = 0; i < nsegments; i++) {
+        partial_segment *segment = &segments.segment[i];
+
+        segment->segments = &segments;
+        segment->begin = size * i / nsegments;
+        segment->end = size * (i + 1) / nsegments;
+        segment->now = 0;
+        segment->mirror = 0;
+    }
+
+    for (i = 0; i < nsegments; i++) {
+        partial_segment *segment = &segments.segment[i];
+        CURLcode code = CURLE_OK;
+
+        if (::vpkg::transfer_init(&segment->transfer, downloader, partial->mirrors[0].c_str()) != 0) {
+            rv = CURLE_FAILED_INIT;
+            break;
+        }
+
+        segment->transfer.done = segment_done;
+        segment->transfer.user = segment;
+
+        code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_FAILONERROR, 1L) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_WRITEFUNCTION, segment_write) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_WRITEDATA, segment) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_XFERINFOFUNCTION, segment_progress) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_XFERINFODATA, segment) : code;
+        code = (code == CURLE_OK) ? curl_easy_setopt(segment->transfer.easy, CURLOPT_NOPROGRESS, 0L) : code;
+
+        if (code != CURLE_OK || segment_request(segment) != 0) {
+            ::vpkg::transfer_fini(&segment->transfer);
+            rv = CURLE_FAILED_INIT;
+            break;
+        }
+
+        nsubmitted++;
+    }
+
+    for (i = 0; i < nsubmitted; i++) {
+        RETRY_EINTR(sem_wait(&segments.sem_done));
+    }
+
+    // Keep what can be resumed: everything up to the first incomplete range.
+    partial->offset = 0;
+
+    for (i = 0; i < nsubmitted; i++) {
+        partial_segment *segment = &segments.segment[i];
+
+        if (rv == CURLE_OK && segment->transfer.code != CURLE_OK) {
+            // segment_write refused a response other than 206.
+            rv = (segment->transfer.code == CURLE_WRITE_ERROR && !segment->ranged) ? CURLE_RANGE_ERROR : segment->transfer.code;
+        }
+
+        if (partial->offset == segment->begin) {
+            partial->offset += segment->now;
+        }
+
+        ::vpkg::transfer_fini(&segment->transfer);
+    }
+
+    if (rv == CURLE_OK && partial->offset != size) {
+        rv = CURLE_PARTIAL_FILE;
+    }
+
+    sem_destroy(&segments.sem_done);
+    curl_slist_free_all(segments.headers);
+
+    partial->start = partial->offset;
+
+    if (ftruncate(partial->fd, partial->offset) < 0 || lseek(partial->fd, partial->offset, SEEK_SET) < 0) {
+        return CURLE_WRITE_ERROR;
+    }
+
+    partial->preallocated = false;
+    return rv;
+}
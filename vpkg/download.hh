@@ -0,0 +1,286 @@
+#ifndef VPKG_DOWNLOAD_HH_
+#define VPKG_DOWNLOAD_HH_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "vpkg/hash.hh"
+
+namespace vpkg {
+// Parallel connections per host, transfers beyond that wait for a free
+// connection or are multiplexed over HTTP/2.
+#define VPKG_DOWNLOAD_HOST_CONNECTIONS 6
+
+// Default number of packages downloaded at once.
+#define VPKG_DOWNLOAD_JOBS 8
+
+// Files of at least that size are downloaded as VPKG_DOWNLOAD_SEGMENTS ranges
+// in parallel, if the server supports ranges.
+#define VPKG_SEGMENT_MIN_SIZE (32 << 20)
+#define VPKG_DOWNLOAD_SEGMENTS 4
+
+// Attempts of a transfer that is rate limited or fails before a response.
+#define VPKG_DOWNLOAD_RETRIES 6
+
+// Backoff between attempts, doubled for every consecutive failure of a host.
+#define VPKG_DOWNLOAD_BACKOFF_MS 500
+#define VPKG_DOWNLOAD_BACKOFF_MAX_MS 60000
+
+// Longer Retry-After requests are not waited for, the transfer fails.
+#define VPKG_DOWNLOAD_RETRY_AFTER_MAX 300
+
+// Transfers slower than VPKG_DOWNLOAD_STALL_SPEED bytes per second for
+// VPKG_DOWNLOAD_STALL_TIME seconds are considered stalled and aborted.
+#define VPKG_DOWNLOAD_STALL_SPEED 4096
+#define VPKG_DOWNLOAD_STALL_TIME 15
+#define VPKG_DOWNLOAD_CONNECT_TIMEOUT 15
+
+struct transfer;
+
+typedef void (*transfer_done_fn)(::vpkg::transfer *transfer, CURLcode code);
+
+// Called on the thread of the downloader for every attempt of a transfer.
+typedef void (*transfer_observe_fn)(void *user, ::vpkg::transfer *transfer, CURLcode code);
+
+// Called with the number of bytes at the start of a partial file that are
+// written, whenever it changes.
+typedef void (*partial_written_fn)(void *user, curl_off_t written);
+
+struct transfer {
+    CURL *easy;
+
+    // Called on the thread of the downloader once the transfer finished.
+    ::vpkg::transfer_done_fn done;
+    void *user;
+
+    CURLcode code;
+
+    std::string url;
+
+    // Host of the url, requests are limited per host.
+    std::string host;
+    int attempts;
+    int max_attempts;
+};
+
+/*!
+ * Requests in flight to a host. The limit adapts to how the host copes:
+ * halved on every rate limited or failed request and raised by one after
+ * limit successful requests in a row. Getting back to the limit that failed
+ * last takes many more successes, so a host with a fixed limit isn't probed
+ * over and over. Only used by the downloader thread.
+ */
+struct host_budget {
+    int limit;
+    int ceiling;
+    int active;
+    int successes;
+
+    // Consecutive failures, for the backoff.
+    int failures;
+
+    // Monotonic time in ms before which no request is started.
+    int64_t not_before;
+
+    std::deque<::vpkg::transfer *> waiting;
+};
+
+/*!
+ * Download engine shared by all worker threads. A single thread drives every
+ * transfer through one multi handle, and a share handle keeps DNS entries,
+ * TLS sessions and connections, so transfers to the same host reuse them.
+ */
+struct downloader {
+    CURLM *multi;
+    CURLSH *share;
+    pthread_t thread;
+
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+    // Protected by lock.
+    pthread_mutex_t lock;
+    std::vector<::vpkg::transfer *> pending;
+    bool stop;
+
+    // Only used by the downloader thread.
+    std::map<std::string, ::vpkg::host_budget> hosts;
+    unsigned int seed;
+
+    // Set before any transfer is submitted.
+    ::vpkg::transfer_observe_fn observe;
+    void *observe_user;
+};
+
+int downloader_init(::vpkg::downloader *downloader);
+
+/*!
+ * Wait for all submitted transfers to finish and release the downloader.
+ */
+void downloader_fini(::vpkg::downloader *downloader);
+
+/*!
+ * Create the easy handle of transfer for url, using the share handle of
+ * downloader. The caller sets at least how to write the data.
+ *
+ * A transfer that is rate limited (429, 503) or gets no response at all is
+ * retried by the downloader with backoff, up to max_attempts times, so its
+ * callbacks must not have written anything in that case.
+ */
+int transfer_init(::vpkg::transfer *transfer, ::vpkg::downloader *downloader, const char *url);
+void transfer_fini(::vpkg::transfer *transfer);
+
+/*!
+ * Point transfer to url, for example another mirror of the same file.
+ */
+int transfer_set_url(::vpkg::transfer *transfer, const char *url);
+
+/*!
+ * Start transfer. transfer->done is called once it finished.
+ */
+int downloader_submit(::vpkg::downloader *downloader, ::vpkg::transfer *transfer);
+
+/*!
+ * Start transfer and wait for it to finish, transfer->done and user are
+ * overwritten.
+ *
+ * @return the result of the transfer.
+ */
+CURLcode downloader_perform(::vpkg::downloader *downloader, ::vpkg::transfer *transfer);
+
+/*!
+ * A download into path that survives interruptions. The bytes received so
+ * far stay in path, and the sidecar <path>.resume records the url, the
+ * validator (ETag or Last-Modified) of the response and the offset. The next
+ * attempt asks only for the missing bytes with Range and If-Range, and starts
+ * over if the server no longer has the same file.
+ *
+ * The missing bytes may come from another mirror, without If-Range. Mirrors
+ * are expected to serve the same file under the same path.
+ *
+ * If the size and hash of the file are known, the bytes are hashed as they
+ * are written, and a response of the wrong size is refused right away.
+ */
+struct partial {
+    int fd;
+    char *sidecar_path;
+    const char *url;
+
+    // Offset the current request started from, and bytes in the file.
+    curl_off_t start;
+    curl_off_t offset;
+
+    // Of the response currently being received.
+    long status;
+    std::string pending_validator;
+    curl_off_t range_start;
+    bool accept_ranges;
+
+    // Content-Length and the size of the whole file from Content-Range, -1
+    // if not sent.
+    curl_off_t content_length;
+    curl_off_t range_total;
+
+    // Sent with If-Range and kept in the sidecar. Validators differ between
+    // servers, so it is only sent to the url it was received from.
+    std::string validator;
+    std::string validator_url;
+
+    // Urls of the file on all mirrors, best first. Only url unless the caller
+    // sets more before the first request.
+    std::vector<std::string> mirrors;
+    std::string request_url;
+
+    char range[32];
+    struct curl_slist *headers;
+
+    // Expected digest, empty if unknown, and size, -1 if unknown.
+    std::string expected_sha256;
+    curl_off_t expected_size;
+
+    // Digest of the first hashed bytes of the file, if the digest is known.
+    ::vpkg::sha256 sha;
+    curl_off_t hashed;
+
+    // Set once a response turned out to be of another file.
+    bool mismatch;
+
+    // Set while the file is allocated past offset, holes and all. Only the
+    // offset in the sidecar tells how much of it was written then.
+    bool preallocated;
+
+    // Set by the caller to follow the file while it is written, called on
+    // the thread of the downloader, or of partial_reset.
+    ::vpkg::partial_written_fn written;
+    void *written_user;
+};
+
+/*!
+ * Open path and resume from the offset in its sidecar, if it is still valid
+ * for url. Otherwise path is truncated.
+ */
+int partial_open(::vpkg::partial *partial, const char *path, const char *url);
+
+/*!
+ * Verify the file of partial against sha256 and size, either of which may
+ * be unknown (empty or -1). The bytes already in the file are hashed now,
+ * the rest as it arrives.
+ */
+int partial_expect(::vpkg::partial *partial, std::string_view sha256, curl_off_t size);
+
+/*!
+ * Check the complete file of partial against what partial_expect was given.
+ *
+ * @return nonzero with errno set to EBADMSG if it doesn't match.
+ */
+int partial_verify(::vpkg::partial *partial);
+
+/*!
+ * Close the file. Once complete the sidecar is removed, otherwise it is
+ * updated to the current offset.
+ */
+int partial_close(::vpkg::partial *partial, bool complete);
+
+/*!
+ * Forget the bytes received so far, the next request starts from zero.
+ */
+int partial_reset(::vpkg::partial *partial);
+
+/*!
+ * Make transfer write into partial and ask for the missing bytes. The
+ * transfer must not outlive partial.
+ */
+int partial_setup(::vpkg::partial *partial, ::vpkg::transfer *transfer);
+
+/*!
+ * Ask for the size of the file of partial with a HEAD request to the first
+ * mirror.
+ *
+ * @return the size, or -1 if the server does not support ranges or has no
+ * validator for the file, so it can't be downloaded in segments.
+ */
+curl_off_t partial_probe(::vpkg::downloader *downloader, ::vpkg::partial *partial);
+
+/*!
+ * Download the size bytes of the file of partial as nsegments ranges at
+ * once, written into the preallocated file. The transfers count towards the
+ * connection limit of the host like any other. progress is called with the
+ * combined progress of all ranges. A range that stalls or fails continues
+ * from where it stopped on the next mirror, if there is one.
+ *
+ * On failure the bytes before the first incomplete range are kept, so a
+ * later attempt resumes from there.
+ *
+ * @return CURLE_RANGE_ERROR if a range was not answered with the expected
+ * partial content, the file should be downloaded in one piece instead.
+ */
+CURLcode partial_segmented(::vpkg::downloader *downloader, ::vpkg::partial *partial, curl_off_t size, int nsegments,
+                           curl_xferinfo_callback progress, void *clientp);
+}
+
+#endif // VPKG_DOWNLOAD_HH_
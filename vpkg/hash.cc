@@ -0,0 +1,142 @@
+#include "vpkg/hash.hh"
+
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+
+int ::vpkg::sha256_init(::vpkg::sha256 *sha)
+{
+    sha->ctx = EVP_MD_CTX_new();
+    if (sha->ctx == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (::vpkg::sha256_reset(sha) != 0) {
+        EVP_MD_CTX_free(sha->ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+void ::vpkg::sha256_fini(::vpkg::sha256 *sha)
+{
+    EVP_MD_CTX_free(sha->ctx);
+}
+
+int ::vpkg::sha256_reset(::vpkg::sha256 *sha)
+{
+    if (EVP_DigestInit_ex(sha->ctx, EVP_sha256(), NULL) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ::vpkg::sha256_update(::vpkg::sha256 *sha, const void *data, size_t len)
+{
+    if (EVP_DigestUpdate(sha->ctx, data, len) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int ::vpkg::sha256_update_fd(::vpkg::sha256 *sha, int fd, off_t offset, off_t len)
+{
+    char buf[1 << 16];
+
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len < (off_t)sizeof(buf) ? len : sizeof(buf), offset);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            // The file is shorter than it should be.
+            errno = EIO;
+            return -1;
+        }
+
+        if (::vpkg::sha256_update(sha, buf, n) != 0) {
+            return -1;
+        }
+
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int ::vpkg::sha256_final(::vpkg::sha256 *sha, char hex[VPKG_SHA256_HEX_SIZE])
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char md[VPKG_SHA256_SIZE];
+
+    if (EVP_DigestFinal_ex(sha->ctx, md, NULL) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < VPKG_SHA256_SIZE; i++) {
+        hex[2 * i] = digits[md[i] >> 4];
+        hex[2 * i + 1] = digits[md[i] & 0xf];
+    }
+
+    hex[2 * VPKG_SHA256_SIZE] = '\0';
+    return 0;
+}
+
+int ::vpkg::sha256_file(const char *path, char hex[VPKG_SHA256_HEX_SIZE])
+{
+    ::vpkg::sha256 sha;
+    struct stat st;
+    int rv = -1;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        goto out_close;
+    }
+
+    if (::vpkg::sha256_init(&sha) != 0) {
+        goto out_close;
+    }
+
+    if (::vpkg::sha256_update_fd(&sha, fd, 0, st.st_size) == 0 && ::vpkg::sha256_final(&sha, hex) == 0) {
+        rv = 0;
+    }
+
+    ::vpkg::sha256_fini(&sha);
+
+out_close:
+    close(fd);
+    return rv;
+}
+
+bool vpkg::sha256_valid(std::string_view s)
+{
+    if (s.size() != 2 * VPKG_SHA256_SIZE) {
+        return false;
+    }
+
+    for (char c : s) {
+        if (!isxdigit((unsigned char)c)) {
+            return false;
+        }
+    }
+
+    return true;
+}
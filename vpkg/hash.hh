@@ -0,0 +1,57 @@
+#ifndef VPKG_HASH_HH_
+#define VPKG_HASH_HH_
+
+#include <string_view>
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+namespace vpkg {
+#define VPKG_SHA256_SIZE 32
+
+// Lowercase hex digest, including the terminating NUL.
+#define VPKG_SHA256_HEX_SIZE (2 * VPKG_SHA256_SIZE + 1)
+
+/*!
+ * Incremental SHA-256, so data can be hashed while it is written instead of
+ * reading it back afterwards.
+ */
+struct sha256 {
+    EVP_MD_CTX *ctx;
+};
+
+int sha256_init(::vpkg::sha256 *sha);
+void sha256_fini(::vpkg::sha256 *sha);
+
+/*!
+ * Start over, forgetting everything hashed so far.
+ */
+int sha256_reset(::vpkg::sha256 *sha);
+
+int sha256_update(::vpkg::sha256 *sha, const void *data, size_t len);
+
+/*!
+ * Hash the len bytes of fd at offset, without moving its file offset.
+ */
+int sha256_update_fd(::vpkg::sha256 *sha, int fd, off_t offset, off_t len);
+
+/*!
+ * Write the digest of everything hashed so far to hex. sha has to be reset
+ * before it is used again.
+ */
+int sha256_final(::vpkg::sha256 *sha, char hex[VPKG_SHA256_HEX_SIZE]);
+
+/*!
+ * Hash the whole file at path.
+ */
+int sha256_file(const char *path, char hex[VPKG_SHA256_HEX_SIZE]);
+
+/*!
+ * @return true if s is a hex digest as written by sha256_final, in either case.
+ */
+bool sha256_valid(std::string_view s);
+}
+
+#endif // VPKG_HASH_HH_
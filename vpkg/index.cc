@@ -0,0 +1,375 @@
+#include "vpkg/index.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "vpkg/util.hh"
+
+static bool index_matches(const vpkg::index_header *hdr, size_t len, uint64_t fingerprint)
+{
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, VPKG_INDEX_MAGIC, sizeof(hdr->magic)) != 0) {
+        return false;
+    }
+
+    if (hdr->version != VPKG_INDEX_VERSION) {
+        return false;
+    }
+
+    if (hdr->source_fingerprint != fingerprint) {
+        return false;
+    }
+
+    if (hdr->entries_off > len || (len - hdr->entries_off) / sizeof(vpkg::index_entry) < hdr->count) {
+        return false;
+    }
+
+    if (hdr->trigrams_off % alignof(vpkg::index_trigram) != 0 || hdr->trigrams_off > len ||
+        (len - hdr->trigrams_off) / sizeof(vpkg::index_trigram) < hdr->trigrams_count) {
+        return false;
+    }
+
+    if (hdr->postings_off % alignof(uint32_t) != 0 || hdr->postings_off > len ||
+        (len - hdr->postings_off) / sizeof(uint32_t) < hdr->postings_count) {
+        return false;
+    }
+
+    if (hdr->strings_off > len || len - hdr->strings_off < hdr->strings_len) {
+        return false;
+    }
+
+    auto trigrams = (const vpkg::index_trigram *)((const char *)hdr + hdr->trigrams_off);
+    for (uint64_t i = 0; i < hdr->trigrams_count; i++) {
+        if (trigrams[i].off > hdr->postings_count || hdr->postings_count - trigrams[i].off < trigrams[i].count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::string_view index_string_view(const vpkg::index_header *hdr, vpkg::index_string s)
+{
+    const char *strings = (const char *)hdr + hdr->strings_off;
+
+    if (s.off > hdr->strings_len || hdr->strings_len - s.off < s.len) {
+        return std::string_view{};
+    }
+
+    return std::string_view{strings + s.off, s.len};
+}
+
+static vpkg::package index_package(const vpkg::index_header *hdr, const vpkg::index_entry *e)
+{
+    vpkg::package pkg;
+
+    pkg.url = index_string_view(hdr, e->url);
+    pkg.deps = index_string_view(hdr, e->deps);
+    pkg.provides = index_string_view(hdr, e->provides);
+    pkg.replaces = index_string_view(hdr, e->replaces);
+    pkg.version = index_string_view(hdr, e->version);
+    pkg.not_deps = index_string_view(hdr, e->not_deps);
+    pkg.last_modified = (time_t)e->last_modified;
+    pkg.sha256 = index_string_view(hdr, e->sha256);
+    pkg.size = e->size;
+
+    std::string_view vkey = index_string_view(hdr, e->vkey);
+    if (vkey.size() && (uintptr_t)vkey.data() % alignof(int32_t) == 0) {
+        pkg.vkey.v = (const int32_t *)vkey.data();
+        pkg.vkey.n = vkey.size() / sizeof(int32_t);
+    }
+
+    return pkg;
+}
+
+int ::vpkg::index_load(::vpkg::config *config, const char *index_path, uint64_t fingerprint)
+{
+    int rc = 1;
+    struct stat ist;
+    void *data;
+    int fd;
+
+    fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return rc;
+    }
+
+    if (fstat(fd, &ist) < 0 || ist.st_size < (off_t)sizeof(vpkg::index_header)) {
+        goto out_close;
+    }
+
+    data = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        goto out_close;
+    }
+
+    {
+        auto hdr = static_cast<const vpkg::index_header *>(data);
+
+        if (!index_matches(hdr, ist.st_size, fingerprint)) {
+            munmap(data, ist.st_size);
+            errno = ESTALE;
+            goto out_close;
+        }
+
+        auto entries = (const vpkg::index_entry *)((const char *)data + hdr->entries_off);
+
+        // Entries are sorted by name, and so unique.
+        int err = config->packages.assign(
+            hdr->count, [&](uint32_t i) { return entries[i].hash; },
+            [&](uint32_t i) { return vpkg::packages::value_type{index_string_view(hdr, entries[i].name), index_package(hdr, &entries[i])}; });
+
+        if (err != 0) {
+            munmap(data, ist.st_size);
+            goto out_close;
+        }
+    }
+
+    config->mappings.push_back({data, (size_t)ist.st_size});
+    config->index = static_cast<const vpkg::index_header *>(data);
+    rc = 0;
+
+out_close:
+    close(fd);
+    return rc;
+}
+
+static vpkg::index_string index_string_add(std::string *strings, std::string_view s)
+{
+    vpkg::index_string out;
+
+    out.off = strings->size();
+    out.len = s.size();
+    strings->append(s);
+
+    return out;
+}
+
+static vpkg::index_string index_key_add(std::string *strings, const vpkg::version_key *key)
+{
+    if (key->v == NULL || key->n == 0) {
+        return vpkg::index_string{0, 0};
+    }
+
+    strings->resize((strings->size() + alignof(int32_t) - 1) & ~(alignof(int32_t) - 1));
+    return index_string_add(strings, std::string_view{(const char *)key->v, key->n * sizeof(int32_t)});
+}
+
+static uint32_t trigram_at(const char *s)
+{
+    return (uint32_t)(unsigned char)s[0] << 16 | (uint32_t)(unsigned char)s[1] << 8 | (unsigned char)s[2];
+}
+
+/*
+ * Build the trigram table from the names of the entries. Every entry is listed
+ * at most once per trigram.
+ */
+static void index_trigrams_build(const std::vector<std::string_view> &names, std::vector<vpkg::index_trigram> *trigrams, std::vector<uint32_t> *postings)
+{
+    std::vector<uint64_t> pairs;
+
+    for (uint32_t i = 0; i < names.size(); i++) {
+        for (size_t j = 0; j + 3 <= names[i].size(); j++) {
+            pairs.push_back((uint64_t)trigram_at(names[i].data() + j) << 32 | i);
+        }
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    postings->reserve(pairs.size());
+
+    for (uint64_t pair : pairs) {
+        uint32_t trigram = pair >> 32;
+
+        if (trigrams->empty() || trigrams->back().trigram != trigram) {
+            trigrams->push_back(vpkg::index_trigram{trigram, 0, postings->size()});
+        }
+
+        trigrams->back().count++;
+        postings->push_back((uint32_t)pair);
+    }
+}
+
+int ::vpkg::index_write(const ::vpkg::config *config, const char *index_path, uint64_t fingerprint)
+{
+    vpkg::index_header hdr;
+    std::vector<vpkg::index_entry> entries;
+    std::vector<std::string_view> names;
+    std::vector<vpkg::index_trigram> trigrams;
+    std::vector<uint32_t> postings;
+    std::string strings;
+    char *tmp_path;
+    FILE *f;
+    int fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    entries.reserve(config->packages.size());
+
+    for (auto &it : config->packages.sorted()) {
+        vpkg::index_entry e;
+
+        e.name = index_string_add(&strings, it->first);
+        e.url = index_string_add(&strings, it->second.url);
+        e.deps = index_string_add(&strings, it->second.deps);
+        e.provides = index_string_add(&strings, it->second.provides);
+        e.replaces = index_string_add(&strings, it->second.replaces);
+        e.version = index_string_add(&strings, it->second.version);
+        e.not_deps = index_string_add(&strings, it->second.not_deps);
+        e.vkey = index_key_add(&strings, &it->second.vkey);
+        e.sha256 = index_string_add(&strings, it->second.sha256);
+        e.last_modified = it->second.last_modified;
+        e.size = it->second.size;
+        e.hash = vpkg::packages_hash(it->first);
+
+        entries.push_back(e);
+        names.push_back(it->first);
+    }
+
+    index_trigrams_build(names, &trigrams, &postings);
+
+    if (strings.size() > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    memcpy(hdr.magic, VPKG_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = VPKG_INDEX_VERSION;
+    hdr.count = entries.size();
+    hdr.source_fingerprint = fingerprint;
+    hdr.entries_off = sizeof(hdr);
+    hdr.trigrams_off = hdr.entries_off + entries.size() * sizeof(vpkg::index_entry);
+    hdr.trigrams_count = trigrams.size();
+    hdr.postings_off = hdr.trigrams_off + trigrams.size() * sizeof(vpkg::index_trigram);
+    hdr.postings_count = postings.size();
+    hdr.strings_off = hdr.postings_off + postings.size() * sizeof(uint32_t);
+    hdr.strings_len = strings.size();
+
+    if (asprintf(&tmp_path, "%s.XXXXXX", index_path) < 0) {
+        return -1;
+    }
+
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        free_preserve_errno(tmp_path);
+        return -1;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        goto out_unlink;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(entries.data(), sizeof(vpkg::index_entry), entries.size(), f) != entries.size() ||
+        fwrite(trigrams.data(), sizeof(vpkg::index_trigram), trigrams.size(), f) != trigrams.size() ||
+        fwrite(postings.data(), sizeof(uint32_t), postings.size(), f) != postings.size() ||
+        fwrite(strings.data(), 1, strings.size(), f) != strings.size()) {
+        fclose(f);
+        goto out_unlink;
+    }
+
+    if (fchmod(fileno(f), 0644) < 0) {
+        fclose(f);
+        goto out_unlink;
+    }
+
+    if (fclose(f) != 0) {
+        goto out_unlink;
+    }
+
+    if (rename(tmp_path, index_path) < 0) {
+        goto out_unlink;
+    }
+
+    free(tmp_path);
+    return 0;
+
+out_unlink:
+    unlink(tmp_path);
+    free_preserve_errno(tmp_path);
+    return -1;
+}
+
+static const vpkg::index_trigram *index_trigram_find(const vpkg::index_header *hdr, uint32_t trigram)
+{
+    auto begin = (const vpkg::index_trigram *)((const char *)hdr + hdr->trigrams_off);
+    auto end = begin + hdr->trigrams_count;
+
+    auto it = std::lower_bound(begin, end, trigram, [](const vpkg::index_trigram &t, uint32_t v) {
+        return t.trigram < v;
+    });
+
+    return it != end && it->trigram == trigram ? it : NULL;
+}
+
+int ::vpkg::index_candidates(const ::vpkg::index_header *hdr, std::string_view pattern, std::vector<uint32_t> *out)
+{
+    auto postings = (const uint32_t *)((const char *)hdr + hdr->postings_off);
+    std::vector<const vpkg::index_trigram *> lists;
+
+    out->clear();
+
+    if (pattern.size() < 3) {
+        return -1;
+    }
+
+    for (size_t i = 0; i + 3 <= pattern.size(); i++) {
+        const vpkg::index_trigram *t = index_trigram_find(hdr, trigram_at(pattern.data() + i));
+
+        // No name contains this trigram.
+        if (t == NULL) {
+            return 0;
+        }
+
+        lists.push_back(t);
+    }
+
+    // Intersect starting with the rarest trigram, to keep the candidates few.
+    std::sort(lists.begin(), lists.end(), [](const vpkg::index_trigram *a, const vpkg::index_trigram *b) {
+        return a->count < b->count;
+    });
+
+    out->assign(postings + lists[0]->off, postings + lists[0]->off + lists[0]->count);
+
+    // Only these can be candidates, so the others need no check.
+    for (uint32_t candidate : *out) {
+        if (candidate >= hdr->count) {
+            out->clear();
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    for (size_t i = 1; i < lists.size() && !out->empty(); i++) {
+        const uint32_t *begin = postings + lists[i]->off;
+        const uint32_t *end = begin + lists[i]->count;
+        size_t n = 0;
+
+        for (uint32_t candidate : *out) {
+            begin = std::lower_bound(begin, end, candidate);
+            if (begin == end) {
+                break;
+            }
+
+            if (*begin == candidate) {
+                (*out)[n++] = candidate;
+            }
+        }
+
+        out->resize(n);
+    }
+
+    return 0;
+}
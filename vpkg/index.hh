@@ -0,0 +1,100 @@
+#ifndef VPKG_INDEX_HH_
+#define VPKG_INDEX_HH_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string_view>
+#include <vector>
+
+#include "vpkg/config.hh"
+
+namespace vpkg {
+#define VPKG_INDEX_MAGIC "vpkgidx"
+#define VPKG_INDEX_VERSION 6
+#define VPKG_INDEX_SUFFIX ".idx"
+#define VPKG_INDEX_NAME ".index"
+
+struct index_string {
+    uint32_t off;
+    uint32_t len;
+};
+
+struct index_entry {
+    index_string name;
+    index_string url;
+    index_string deps;
+    index_string provides;
+    index_string replaces;
+    index_string version;
+    index_string not_deps;
+    index_string vkey; /* int32_t components, 4 byte aligned */
+    index_string sha256;
+    int64_t last_modified;
+    uint64_t size;
+    uint64_t hash;
+};
+
+/*
+ * The entries whose names contain a trigram, as a range of postings.
+ */
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t off;
+};
+
+/*
+ * On-disk layout, native endianness:
+ *
+ * index_header
+ * index_entry[count], sorted by name
+ * index_trigram[trigrams_count], sorted by trigram
+ * uint32_t postings[postings_count], ascending entry numbers per trigram
+ * char strings[strings_len]
+ */
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+
+    /* fingerprint of the source files, used to detect a stale index */
+    uint64_t source_fingerprint;
+
+    uint64_t entries_off;
+    uint64_t trigrams_off;
+    uint64_t trigrams_count;
+    uint64_t postings_off;
+    uint64_t postings_count;
+    uint64_t strings_off;
+    uint64_t strings_len;
+};
+
+/*!
+ * Map the compiled index belonging to the ini files with the given
+ * fingerprint.
+ *
+ * @return nonzero if the index does not exist, is stale or malformed. On
+ * success, the packages of config are populated from the index, in index
+ * order, the mapping is added to config->mappings and config->index is set.
+ */
+int index_load(::vpkg::config *config, const char *index_path, uint64_t fingerprint);
+
+/*!
+ * Atomically (re)write the index for the packages of config, tagging it with
+ * the fingerprint of the source files.
+ */
+int index_write(const ::vpkg::config *config, const char *index_path, uint64_t fingerprint);
+
+/*!
+ * Collect the entry numbers of all names that may contain pattern, ascending.
+ * Entry numbers are positions in config->packages, if it was loaded from hdr.
+ * Candidates still have to be checked against the pattern.
+ *
+ * @return nonzero if the pattern is too short to be looked up, or the postings
+ * point past the entries of a corrupt index.
+ */
+int index_candidates(const ::vpkg::index_header *hdr, std::string_view pattern, std::vector<uint32_t> *out);
+}
+
+#endif // VPKG_INDEX_HH_
@@ -0,0 +1,283 @@
+#include "vpkg/installed.hh"
+
+#include <sys/stat.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <algorithm>
+
+#include "vpkg/util.hh"
+
+/*
+ * The pkgdb is replaced by rename on every update, so its stat identifies its
+ * version. Without it nothing identifies the list, it must not be cached.
+ */
+static int installed_header(struct xbps_handle *xhp, std::string *header)
+{
+    std::string path = std::string{xhp->metadir} + "/" + XBPS_PKGDB;
+    struct stat st;
+    char *buf;
+
+    if (stat(path.c_str(), &st) < 0) {
+        return -1;
+    }
+
+    if (asprintf(&buf, VPKG_INSTALLED_MAGIC " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64 "\n",
+                 (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                 (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec) < 0) {
+        return -1;
+    }
+
+    *header = buf;
+    free(buf);
+
+    return 0;
+}
+
+/*
+ * Split data into packages, terminating every field in place.
+ */
+static int installed_parse(::vpkg::installed *installed)
+{
+    char *at = installed->data.data();
+    char *end = at + installed->data.size();
+
+    installed->packages.clear();
+
+    // Skip the header.
+    at = (char *)memchr(at, '\n', end - at);
+    if (at == NULL) {
+        return -1;
+    }
+
+    for (at++; at < end;) {
+        vpkg::installed_package pkg;
+        char *field_end;
+
+        char *eol = (char *)memchr(at, '\n', end - at);
+        if (eol == NULL) {
+            return -1;
+        }
+
+        *eol = '\0';
+
+        pkg.pkgname = at;
+        if ((field_end = strchr(at, ' ')) == NULL) {
+            return -1;
+        }
+
+        *field_end = '\0';
+
+        pkg.pkgver = at = field_end + 1;
+        if ((field_end = strchr(at, ' ')) == NULL) {
+            return -1;
+        }
+
+        *field_end = '\0';
+
+        errno = 0;
+        pkg.install_time = (time_t)strtoll(field_end + 1, &at, 10);
+        if (errno != 0 || at != eol) {
+            return -1;
+        }
+
+        installed->packages.push_back(pkg);
+        at = eol + 1;
+    }
+
+    std::sort(installed->packages.begin(), installed->packages.end(), [](const vpkg::installed_package &a, const vpkg::installed_package &b) {
+        return strcmp(a.pkgname, b.pkgname) < 0;
+    });
+
+    return 0;
+}
+
+static int installed_collect_cb(struct xbps_handle *xhp, xbps_object_t obj, const char *pkgname, void *user_, bool *)
+{
+    xbps_dictionary_t xpkg = static_cast<xbps_dictionary_t>(obj);
+    std::string *data = static_cast<std::string *>(user_);
+    const char *pkgver;
+    time_t install_time = -1;
+    char *buf;
+
+    if (!is_xdeb(xpkg)) {
+        return 0;
+    }
+
+    if (!xbps_dictionary_get_cstring_nocopy(xpkg, "pkgver", &pkgver)) {
+        return 0;
+    }
+
+    if (xbps_install_time(xpkg, &install_time) != 0) {
+        install_time = -1;
+    }
+
+    if (asprintf(&buf, "%s %s %lld\n", pkgname, pkgver, (long long)install_time) < 0) {
+        return errno;
+    }
+
+    data->append(buf);
+    free(buf);
+
+    return 0;
+}
+
+static int installed_write(const std::string &data)
+{
+    char tmp_path[] = VPKG_INSTALLED_PATH ".XXXXXX";
+    int fd;
+
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    for (size_t off = 0; off < data.size();) {
+        ssize_t nw = write(fd, data.data() + off, data.size() - off);
+
+        if (nw < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (nw < 0) {
+            goto out_unlink;
+        }
+
+        off += nw;
+    }
+
+    if (fchmod(fd, 0644) < 0) {
+        goto out_unlink;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        goto out_unlink;
+    }
+
+    fd = -1;
+
+    if (rename(tmp_path, VPKG_INSTALLED_PATH) < 0) {
+        goto out_unlink;
+    }
+
+    return 0;
+
+out_unlink:
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    unlink(tmp_path);
+    return -1;
+}
+
+static int installed_build(::vpkg::installed *installed, struct xbps_handle *xhp, bool cache)
+{
+    std::string header;
+    int rv;
+
+    if (installed_header(xhp, &header) != 0) {
+        header = VPKG_INSTALLED_MAGIC "\n";
+        cache = false;
+    }
+
+    installed->packages.clear();
+    installed->data = header;
+
+    if ((rv = xbps_pkgdb_foreach_cb(xhp, installed_collect_cb, &installed->data)) != 0) {
+        errno = rv;
+        return -1;
+    }
+
+    // Only an optimization, keep going if it can not be saved.
+    if (cache) {
+        installed_write(installed->data);
+    }
+
+    return installed_parse(installed);
+}
+
+int ::vpkg::installed_rebuild(::vpkg::installed *installed, struct xbps_handle *xhp)
+{
+    return installed_build(installed, xhp, true);
+}
+
+int ::vpkg::installed_init(::vpkg::installed *installed, struct xbps_handle *xhp, unsigned flags)
+{
+    bool cache = !(flags & INSTALLED_READONLY);
+    std::string header;
+    char buf[BUFSIZ];
+    ssize_t nr;
+    int fd;
+
+    if (installed_header(xhp, &header) != 0) {
+        return installed_build(installed, xhp, cache);
+    }
+
+    fd = open(VPKG_INSTALLED_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return installed_build(installed, xhp, cache);
+    }
+
+    installed->data.clear();
+
+    while ((nr = read(fd, buf, sizeof(buf))) != 0) {
+        if (nr < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (nr < 0) {
+            break;
+        }
+
+        installed->data.append(buf, nr);
+    }
+
+    close(fd);
+
+    if (nr < 0 || installed->data.compare(0, header.size(), header) != 0 ||
+        installed_parse(installed) != 0) {
+        return installed_build(installed, xhp, cache);
+    }
+
+    return 0;
+}
+
+const ::vpkg::installed_package *::vpkg::installed_find(const ::vpkg::installed *installed, std::string_view pkgname)
+{
+    auto it = std::lower_bound(installed->packages.begin(), installed->packages.end(), pkgname, [](const vpkg::installed_package &p, std::string_view name) {
+        return std::string_view{p.pkgname} < name;
+    });
+
+    if (it == installed->packages.end() || std::string_view{it->pkgname} != pkgname) {
+        return NULL;
+    }
+
+    return &*it;
+}
+
+int ::vpkg::installed_gtver(const ::vpkg::installed *installed, xbps_dictionary_t xpkg, const vpkg::package *vpkg)
+{
+    const vpkg::installed_package *ipkg;
+    const char *pkgname;
+    const char *pkgver;
+
+    if (!xbps_dictionary_get_cstring_nocopy(xpkg, "pkgname", &pkgname) ||
+        !xbps_dictionary_get_cstring_nocopy(xpkg, "pkgver", &pkgver)) {
+        return xbps_vpkg_gtver(xpkg, vpkg);
+    }
+
+    ipkg = vpkg::installed_find(installed, pkgname);
+    if (ipkg == NULL || strcmp(ipkg->pkgver, pkgver) != 0) {
+        return xbps_vpkg_gtver(xpkg, vpkg);
+    }
+
+    return vpkg_gtver(pkgver, ipkg->install_time, vpkg);
+}
@@ -0,0 +1,75 @@
+#ifndef VPKG_INSTALLED_HH_
+#define VPKG_INSTALLED_HH_
+
+#include <string_view>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <xbps.h>
+
+#include "defs.h"
+#include "vpkg/packages.hh"
+
+namespace vpkg {
+#define VPKG_INSTALLED_PATH VPKG_BINPKGS "/installed"
+#define VPKG_INSTALLED_MAGIC "vpkg-installed 1"
+
+struct installed_package {
+    const char *pkgname;
+    const char *pkgver;
+
+    // -1 if it could not be resolved.
+    time_t install_time;
+};
+
+/*!
+ * All installed xdeb packages, without walking the whole pkgdb.
+ *
+ * The list is kept in VPKG_INSTALLED_PATH, one line per package, after a
+ * header identifying the version of the pkgdb it was built from:
+ *
+ * vpkg-installed 1 <dev> <ino> <size> <mtime_sec> <mtime_nsec>
+ * <pkgname> <pkgver> <install_time>
+ */
+struct installed {
+    std::string data;
+
+    // Sorted by pkgname, the strings point into data.
+    std::vector<::vpkg::installed_package> packages;
+};
+
+enum installed_flags {
+    // Never save the list, only read it.
+    INSTALLED_READONLY = 1 << 0,
+};
+
+/*!
+ * Load the list of installed xdeb packages. If it is missing or older than
+ * the pkgdb, it is rebuilt from the pkgdb and saved, if possible and not
+ * INSTALLED_READONLY.
+ *
+ * @return nonzero if the pkgdb could not be read.
+ */
+int installed_init(::vpkg::installed *installed, struct xbps_handle *xhp, unsigned flags = 0);
+
+/*!
+ * Rebuild the list from the pkgdb of xhp and save it, e.g. after a
+ * transaction was committed.
+ */
+int installed_rebuild(::vpkg::installed *installed, struct xbps_handle *xhp);
+
+/*!
+ * @return the installed package named pkgname or NULL.
+ */
+const ::vpkg::installed_package *installed_find(const ::vpkg::installed *installed, std::string_view pkgname);
+
+/*!
+ * xbps_vpkg_gtver for the pkgdb entry xpkg. If the list has an entry with the
+ * same pkgver, its install time is used instead of resolving it again, which
+ * saves parsing install-date or a stat of the binpkg.
+ */
+int installed_gtver(const ::vpkg::installed *installed, xbps_dictionary_t xpkg, const vpkg::package *vpkg);
+}
+
+#endif // VPKG_INSTALLED_HH_
@@ -0,0 +1,287 @@
+#include "vpkg/mirrors.hh"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "vpkg/util.hh"
+
+// Weight of a new measurement in the averages.
+#define MIRROR_ALPHA 0.3
+
+// Smaller transfers say little about the throughput.
+#define MIRROR_MIN_SAMPLE (64 << 10)
+
+static bool mirror_matches(const std::string &base, std::string_view url)
+{
+    return url.starts_with(base) && (url.size() == base.size() || url[base.size()] == '/');
+}
+
+static int mirrors_filter(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
+    size_t suffix = strlen(VPKG_MIRRORS_SUFFIX);
+
+    return d->d_name[0] != '.' && len > suffix && strcmp(d->d_name + len - suffix, VPKG_MIRRORS_SUFFIX) == 0;
+}
+
+/*
+ * One base url per line, the first one is used by the packages of the shard.
+ */
+static int mirrors_load_pool(::vpkg::mirrors *mirrors, const std::string &path)
+{
+    std::vector<::vpkg::mirror> pool;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *f;
+
+    f = fopen(path.c_str(), "re");
+    if (f == NULL) {
+        return -1;
+    }
+
+    while ((len = getline(&line, &size, f)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '/' || line[len - 1] == ' ')) {
+            line[--len] = '\0';
+        }
+
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        pool.push_back(::vpkg::mirror{line, -1, -1, 0});
+    }
+
+    free(line);
+    fclose(f);
+
+    if (pool.size() > 1) {
+        mirrors->pools.push_back(std::move(pool));
+    }
+
+    return 0;
+}
+
+static void mirrors_load_stats(::vpkg::mirrors *mirrors)
+{
+    char base[4096];
+    double latency, throughput;
+    unsigned failures;
+    FILE *f;
+
+    f = fopen(VPKG_MIRRORS_STATS_PATH, "re");
+    if (f == NULL) {
+        return;
+    }
+
+    while (fscanf(f, "%4095s %lf %lf %u", base, &latency, &throughput, &failures) == 4) {
+        for (auto &pool : mirrors->pools) {
+            for (::vpkg::mirror &mirror : pool) {
+                if (mirror.base == base) {
+                    mirror.latency = latency;
+                    mirror.throughput = throughput;
+                    mirror.failures = failures;
+                }
+            }
+        }
+    }
+
+    fclose(f);
+}
+
+static int mirrors_save_stats(::vpkg::mirrors *mirrors)
+{
+    char tmp_path[] = VPKG_MIRRORS_STATS_PATH ".XXXXXX";
+    FILE *f;
+    int fd;
+
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    for (const auto &pool : mirrors->pools) {
+        for (const ::vpkg::mirror &mirror : pool) {
+            fprintf(f, "%s %f %f %u\n", mirror.base.c_str(), mirror.latency, mirror.throughput, mirror.failures);
+        }
+    }
+
+    if (fchmod(fd, 0644) < 0 || fclose(f) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, VPKG_MIRRORS_STATS_PATH) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ::vpkg::mirrors_init(::vpkg::mirrors *mirrors, const char *config_path)
+{
+    struct dirent **names;
+    struct stat st;
+    int n;
+
+    mirrors->dirty = false;
+
+    if ((errno = pthread_mutex_init(&mirrors->lock, NULL)) != 0) {
+        return -1;
+    }
+
+    // A single ini file has no pools.
+    if (stat(config_path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+
+    n = scandir(config_path, &names, mirrors_filter, alphasort);
+    if (n < 0) {
+        pthread_mutex_destroy(&mirrors->lock);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        // An unreadable pool only means the packages have no mirrors.
+        mirrors_load_pool(mirrors, std::string{config_path} + "/" + names[i]->d_name);
+        free(names[i]);
+    }
+
+    free(names);
+
+    mirrors_load_stats(mirrors);
+    return 0;
+}
+
+void ::vpkg::mirrors_fini(::vpkg::mirrors *mirrors)
+{
+    if (mirrors->dirty && mirrors_save_stats(mirrors) != 0) {
+        perror("failed to store mirror statistics");
+    }
+
+    pthread_mutex_destroy(&mirrors->lock);
+}
+
+/*
+ * Seconds a typical download is expected to take. Unmeasured mirrors are
+ * expected to be fast, so each is tried at least once.
+ */
+static double mirror_expected(const ::vpkg::mirror &mirror)
+{
+    double t = mirror.failures * VPKG_MIRROR_FAILURE_PENALTY;
+
+    if (mirror.latency >= 0) {
+        t += mirror.latency;
+    }
+
+    if (mirror.throughput > 0) {
+        t += VPKG_MIRROR_TYPICAL_SIZE / mirror.throughput;
+    }
+
+    return t;
+}
+
+std::vector<std::string> vpkg::mirrors_rank(::vpkg::mirrors *mirrors, const char *url)
+{
+    std::string_view view{url};
+    std::vector<std::pair<double, std::string>> ranked;
+    std::vector<std::string> urls;
+
+    ASSERT_NOERR(pthread_mutex_lock(&mirrors->lock));
+
+    for (const auto &pool : mirrors->pools) {
+        if (!mirror_matches(pool[0].base, view)) {
+            continue;
+        }
+
+        std::string_view path = view.substr(pool[0].base.size());
+
+        for (const ::vpkg::mirror &mirror : pool) {
+            ranked.emplace_back(mirror_expected(mirror), mirror.base + std::string{path});
+        }
+
+        break;
+    }
+
+    ASSERT_NOERR(pthread_mutex_unlock(&mirrors->lock));
+
+    // Ties keep the order of the pool.
+    std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+        return a.first < b.first;
+    });
+
+    for (auto &[expected, mirror_url] : ranked) {
+        urls.push_back(std::move(mirror_url));
+    }
+
+    if (urls.empty()) {
+        urls.push_back(url);
+    }
+
+    return urls;
+}
+
+void ::vpkg::mirrors_observe(void *mirrors_, ::vpkg::transfer *transfer, CURLcode code)
+{
+    ::vpkg::mirrors *mirrors = static_cast<::vpkg::mirrors *>(mirrors_);
+    curl_off_t start = 0, total = 0, size = 0;
+
+    // Local failures say nothing about the mirror.
+    if (code == CURLE_WRITE_ERROR || code == CURLE_ABORTED_BY_CALLBACK || code == CURLE_OUT_OF_MEMORY) {
+        return;
+    }
+
+    curl_easy_getinfo(transfer->easy, CURLINFO_STARTTRANSFER_TIME_T, &start);
+    curl_easy_getinfo(transfer->easy, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(transfer->easy, CURLINFO_SIZE_DOWNLOAD_T, &size);
+
+    ASSERT_NOERR(pthread_mutex_lock(&mirrors->lock));
+
+    for (auto &pool : mirrors->pools) {
+        for (::vpkg::mirror &mirror : pool) {
+            if (!mirror_matches(mirror.base, transfer->url)) {
+                continue;
+            }
+
+            mirrors->dirty = true;
+
+            if (code != CURLE_OK) {
+                mirror.failures++;
+                goto out;
+            }
+
+            mirror.failures = 0;
+
+            double latency = start / 1e6;
+            mirror.latency = mirror.latency < 0 ? latency : (1 - MIRROR_ALPHA) * mirror.latency + MIRROR_ALPHA * latency;
+
+            if (size >= MIRROR_MIN_SAMPLE && total > start) {
+                double throughput = size / ((total - start) / 1e6);
+                mirror.throughput = mirror.throughput < 0 ? throughput : (1 - MIRROR_ALPHA) * mirror.throughput + MIRROR_ALPHA * throughput;
+            }
+
+            goto out;
+        }
+    }
+
+out:
+    ASSERT_NOERR(pthread_mutex_unlock(&mirrors->lock));
+}
@@ -0,0 +1,69 @@
+#ifndef VPKG_MIRRORS_HH_
+#define VPKG_MIRRORS_HH_
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "defs.h"
+#include "vpkg/download.hh"
+
+namespace vpkg {
+#define VPKG_MIRRORS_SUFFIX ".mirrors"
+#define VPKG_MIRRORS_STATS_PATH VPKG_BINPKGS "/mirror-stats"
+
+// Size of a typical download, to weigh the latency of a mirror against its
+// throughput.
+#define VPKG_MIRROR_TYPICAL_SIZE (4 << 20)
+
+// Seconds added to the expected time of a mirror per consecutive failure.
+#define VPKG_MIRROR_FAILURE_PENALTY 30.0
+
+struct mirror {
+    std::string base;
+
+    // Averages of the transfers from this mirror, negative if unknown.
+    double latency;
+    double throughput;
+
+    unsigned failures;
+};
+
+/*!
+ * Pools of mirrors serving the same files under the same paths, read from
+ * the <source>.mirrors files next to the shards. The first base url of a pool
+ * is the one package urls use. Mirrors are ranked by what transfers measured,
+ * which is kept across runs in VPKG_MIRRORS_STATS_PATH.
+ */
+struct mirrors {
+    std::vector<std::vector<::vpkg::mirror>> pools;
+
+    pthread_mutex_t lock;
+    bool dirty;
+};
+
+/*!
+ * Load the pools of config_path, if it is a directory of shards.
+ */
+int mirrors_init(::vpkg::mirrors *mirrors, const char *config_path);
+
+/*!
+ * Store the measurements and release mirrors.
+ */
+void mirrors_fini(::vpkg::mirrors *mirrors);
+
+/*!
+ * @return url on every mirror of its pool, the expected fastest first, or
+ * only url if it is in no pool.
+ */
+std::vector<std::string> mirrors_rank(::vpkg::mirrors *mirrors, const char *url);
+
+/*!
+ * Record the latency and throughput of a finished transfer attempt, to be
+ * used as downloader::observe.
+ */
+void mirrors_observe(void *mirrors, ::vpkg::transfer *transfer, CURLcode code);
+}
+
+#endif // VPKG_MIRRORS_HH_
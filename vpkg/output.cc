@@ -0,0 +1,113 @@
+#include "vpkg/output.hh"
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+vpkg::output::output(int fd) : fd_(fd)
+{
+    buf_ = static_cast<char *>(malloc(CAPACITY));
+    cap_ = buf_ ? CAPACITY : 0;
+}
+
+vpkg::output::~output()
+{
+    flush();
+    free(buf_);
+}
+
+void vpkg::output::write_fd(const char *data, size_t len)
+{
+    while (len && eno_ == 0) {
+        ssize_t nw = ::write(fd_, data, len);
+
+        if (nw < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (nw < 0) {
+            eno_ = errno;
+            break;
+        }
+
+        data += nw;
+        len -= nw;
+    }
+}
+
+void vpkg::output::write(std::string_view s)
+{
+    if (s.empty()) {
+        return;
+    }
+
+    if (cap_ - len_ < s.size()) {
+        flush();
+    }
+
+    // Too large to be worth copying.
+    if (cap_ - len_ < s.size()) {
+        write_fd(s.data(), s.size());
+        return;
+    }
+
+    memcpy(buf_ + len_, s.data(), s.size());
+    len_ += s.size();
+}
+
+void vpkg::output::number(int64_t n)
+{
+    char tmp[24];
+    int len = snprintf(tmp, sizeof(tmp), "%lld", (long long)n);
+
+    write(std::string_view{tmp, (size_t)len});
+}
+
+void vpkg::output::json_string(std::string_view s)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t start = 0;
+
+    put('"');
+
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        write(s.substr(start, i - start));
+        start = i + 1;
+
+        switch (c) {
+        case '"': write("\\\""); break;
+        case '\\': write("\\\\"); break;
+        case '\n': write("\\n"); break;
+        case '\t': write("\\t"); break;
+        default: {
+            char esc[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            write(std::string_view{esc, sizeof(esc)});
+            break;
+        }
+        }
+    }
+
+    write(s.substr(start));
+    put('"');
+}
+
+int vpkg::output::flush()
+{
+    write_fd(buf_, len_);
+    len_ = 0;
+
+    if (eno_ != 0) {
+        errno = eno_;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef VPKG_OUTPUT_HH_
+#define VPKG_OUTPUT_HH_
+
+#include <string_view>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace vpkg {
+/*!
+ * Write buffer for bulk output. Data is only passed to the kernel once the
+ * buffer is full, on flush() and on destruction. If the buffer can not be
+ * allocated, every write goes straight to fd.
+ */
+class output {
+public:
+    explicit output(int fd);
+    output(const output &) = delete;
+    output &operator=(const output &) = delete;
+    ~output();
+
+    void put(char c)
+    {
+        if (len_ < cap_) {
+            buf_[len_++] = c;
+        } else {
+            write(std::string_view{&c, 1});
+        }
+    }
+
+    void write(std::string_view s);
+    void number(int64_t n);
+
+    /*!
+     * Write s as a quoted JSON string.
+     */
+    void json_string(std::string_view s);
+
+    /*!
+     * @return nonzero if any write so far failed, errno is set accordingly.
+     */
+    int flush();
+
+private:
+    static constexpr size_t CAPACITY = 1 << 20;
+
+    int fd_;
+    int eno_ = 0;
+    char *buf_;
+    size_t len_ = 0;
+    size_t cap_;
+
+    void write_fd(const char *data, size_t len);
+};
+}
+
+#endif // VPKG_OUTPUT_HH_
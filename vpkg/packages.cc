@@ -0,0 +1,167 @@
+#include "vpkg/packages.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include <string.h>
+#include <sched.h>
+
+// The source of an entry that is being decoded by another thread.
+static const char node_decoding = 0;
+
+uint64_t vpkg::packages_hash(std::string_view name)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+vpkg::packages::iterator vpkg::packages::find(std::string_view name, uint64_t hash) const
+{
+    if (slots_ == nullptr) {
+        return end();
+    }
+
+    for (size_t i = hash & mask_;; i = (i + 1) & mask_) {
+        const slot *s = &slots_[i];
+
+        if (s->index == 0) {
+            return end();
+        }
+
+        if (s->hash_hi == (uint32_t)(hash >> 32)) {
+            node *n = &nodes_[s->index - 1];
+
+            if (n->value.first == name) {
+                return iterator{this, n};
+            }
+        }
+    }
+}
+
+int vpkg::packages::reserve(size_t n)
+{
+    if (n <= capacity_) {
+        return 0;
+    }
+
+    size_t nslots = 16;
+    while (nslots < 2 * n) {
+        nslots *= 2;
+    }
+
+    node *nodes = arena_.alloc_array<node>(n);
+    slot *slots = arena_.alloc_array<slot>(nslots);
+
+    if (nodes == nullptr || slots == nullptr) {
+        return -1;
+    }
+
+    // The previous arrays stay in the arena until it is destroyed.
+    if (size_) {
+        memcpy((void *)nodes, nodes_, size_ * sizeof(node));
+    }
+
+    memset(slots, 0, nslots * sizeof(slot));
+
+    nodes_ = nodes;
+    slots_ = slots;
+    mask_ = nslots - 1;
+    capacity_ = n;
+
+    for (size_t i = 0; i < size_; i++) {
+        link(i, packages_hash(nodes_[i].value.first));
+    }
+
+    return 0;
+}
+
+void vpkg::packages::link(size_t i, uint64_t hash)
+{
+    size_t j = hash & mask_;
+
+    while (slots_[j].index != 0) {
+        j = (j + 1) & mask_;
+    }
+
+    slots_[j].index = i + 1;
+    slots_[j].hash_hi = hash >> 32;
+}
+
+std::pair<vpkg::packages::iterator, bool> vpkg::packages::insert(const value_type &value, uint64_t hash, const void *source)
+{
+    if (size_ == capacity_ && reserve(capacity_ ? 2 * capacity_ : 64) != 0) {
+        return {end(), false};
+    }
+
+    // The free slot ending the probe sequence is where the entry belongs.
+    size_t j = hash & mask_;
+    for (; slots_[j].index != 0; j = (j + 1) & mask_) {
+        if (slots_[j].hash_hi == (uint32_t)(hash >> 32)) {
+            node *n = &nodes_[slots_[j].index - 1];
+
+            if (n->value.first == value.first) {
+                return {iterator{this, n}, false};
+            }
+        }
+    }
+
+    if (size_ && ordered_ && !(nodes_[size_ - 1].value.first < value.first)) {
+        ordered_ = false;
+    }
+
+    node *n = new (&nodes_[size_]) node{value, source};
+    size_++;
+
+    slots_[j].index = size_;
+    slots_[j].hash_hi = hash >> 32;
+
+    return {iterator{this, n}, true};
+}
+
+std::vector<vpkg::packages::iterator> vpkg::packages::sorted() const
+{
+    std::vector<iterator> out;
+
+    out.reserve(size_);
+    for (size_t i = 0; i < size_; i++) {
+        out.push_back(iterator{this, &nodes_[i]});
+    }
+
+    // Sorting only needs the names, which are valid without decoding.
+    if (!ordered_) {
+        std::sort(out.begin(), out.end(), [](const iterator &a, const iterator &b) {
+            return a.raw().first < b.raw().first;
+        });
+    }
+
+    return out;
+}
+
+void vpkg::packages::materialize(node *n) const
+{
+    std::atomic_ref<const void *> source{n->source};
+    const void *expected = source.load(std::memory_order_acquire);
+
+    if (expected == nullptr) {
+        return;
+    }
+
+    if (expected != &node_decoding && source.compare_exchange_strong(expected, &node_decoding, std::memory_order_acq_rel)) {
+        decoder_(&n->value.second, expected);
+        source.store(nullptr, std::memory_order_release);
+        return;
+    }
+
+    // Another thread is decoding this entry.
+    while (source.load(std::memory_order_acquire) != nullptr) {
+        sched_yield();
+    }
+}
@@ -0,0 +1,188 @@
+#ifndef VPKG_PACKAGES_HH_
+#define VPKG_PACKAGES_HH_
+
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <new>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "vpkg/arena.hh"
+#include "vpkg/version.hh"
+
+namespace vpkg {
+struct package {
+    std::string_view url{};
+    std::string_view deps{};
+    std::string_view provides{};
+    std::string_view replaces{};
+    std::string_view version{};
+    std::string_view not_deps{};
+    time_t last_modified{0};
+
+    // Of the file at url as published by its source, empty and 0 if unknown.
+    std::string_view sha256{};
+    uint64_t size{0};
+
+    // Comparison key of version, v is NULL if it was not precomputed.
+    ::vpkg::version_key vkey{};
+};
+
+uint64_t packages_hash(std::string_view name);
+
+/*!
+ * Open addressing hash table of packages. Entries are stored contiguously in
+ * insertion order, the slot table only holds their indices. All memory is
+ * taken from an arena owned by the table.
+ *
+ * Entries may be inserted lazily, with an opaque source instead of decoded
+ * fields. Such entries are passed to the decoder the first time an iterator
+ * pointing to them is dereferenced.
+ *
+ * Iterators are invalidated by insertions. Lookups and dereferencing are safe
+ * to perform concurrently, as long as nothing is inserted.
+ */
+class packages {
+public:
+    using value_type = std::pair<std::string_view, vpkg::package>;
+
+    /*!
+     * Decode the fields of a lazily inserted entry into pkg. Sources must be
+     * validated before they are inserted, decoding can not fail.
+     */
+    using decoder = void (*)(vpkg::package *pkg, const void *source);
+
+    // The hash is only kept in the slot table, to keep nodes small.
+    struct node {
+        value_type value;
+
+        // Of a lazy entry until it is decoded, NULL once it is.
+        const void *source;
+    };
+
+    class iterator {
+    public:
+        iterator() = default;
+        iterator(const packages *owner, node *n) : owner_(owner), node_(n) {}
+
+        value_type &operator*() const { owner_->materialize(node_); return node_->value; }
+        value_type *operator->() const { owner_->materialize(node_); return &node_->value; }
+        iterator &operator++() { node_++; return *this; }
+        bool operator==(const iterator &other) const { return node_ == other.node_; }
+
+        /*!
+         * Access the entry without decoding it. Only the name and the version
+         * of lazy entries are valid.
+         */
+        value_type &raw() const { return node_->value; }
+        const void *&source() const { return node_->source; }
+
+    private:
+        const packages *owner_ = nullptr;
+        node *node_ = nullptr;
+    };
+
+    packages() = default;
+    packages(const packages &) = delete;
+    packages &operator=(const packages &) = delete;
+
+    iterator begin() const { return iterator{this, nodes_}; }
+    iterator end() const { return iterator{this, nodes_ + size_}; }
+    size_t size() const { return size_; }
+
+    /*!
+     * @return the i-th entry in insertion order.
+     */
+    iterator nth(size_t i) const { return iterator{this, nodes_ + i}; }
+
+    iterator find(std::string_view name) const { return find(name, packages_hash(name)); }
+    iterator find(std::string_view name, uint64_t hash) const;
+
+    /*!
+     * Insert value unless an entry with the same name exists. The second
+     * member of the result is false if the entry already existed. On
+     * allocation failure, end() and false are returned.
+     *
+     * If source is not NULL, the entry is decoded from it on first access.
+     */
+    std::pair<iterator, bool> insert(const value_type &value) { return insert(value, packages_hash(value.first)); }
+    std::pair<iterator, bool> insert(const value_type &value, uint64_t hash, const void *source = nullptr);
+
+    /*!
+     * Preallocate room for n entries.
+     *
+     * @return nonzero if out of memory.
+     */
+    int reserve(size_t n);
+
+    /*!
+     * Fill the empty table with n entries with distinct names, like those of
+     * the index. hash(i) returns the hash of the i-th entry and value(i) the
+     * entry itself. All slots are taken before any entry is written, which
+     * keeps the slot table in cache, and names are not compared.
+     *
+     * @return nonzero if the table is not empty or out of memory.
+     */
+    template<typename Hash, typename Value>
+    int assign(size_t n, Hash &&hash, Value &&value)
+    {
+        if (size_ != 0 || reserve(n) != 0) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            link(i, hash(i));
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            new (&nodes_[i]) node{value(i), nullptr};
+
+            if (i && ordered_ && !(nodes_[i - 1].value.first < nodes_[i].value.first)) {
+                ordered_ = false;
+            }
+        }
+
+        size_ = n;
+        return 0;
+    }
+
+    /*!
+     * @return all entries, ordered by name.
+     */
+    std::vector<iterator> sorted() const;
+
+    void set_decoder(decoder fn) { decoder_ = fn; }
+
+    ::vpkg::arena &arena() { return arena_; }
+
+private:
+    struct slot {
+        uint32_t index;
+        uint32_t hash_hi;
+    };
+
+    ::vpkg::arena arena_;
+
+    node *nodes_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+
+    slot *slots_ = nullptr;
+    size_t mask_ = 0;
+
+    // True as long as entries were inserted in ascending order.
+    bool ordered_ = true;
+
+    decoder decoder_ = nullptr;
+
+    void materialize(node *n) const;
+
+    // Take a slot for the i-th entry.
+    void link(size_t i, uint64_t hash);
+};
+}
+
+#endif // VPKG_PACKAGES_HH_
@@ -42,21 +42,65 @@ bool yes_no_prompt(void)
     return ok && !ferror(stdin);
 }
 
-int xbps_vpkg_gtver(xbps_dictionary_t xpkg, const vpkg::package *vpkg)
+int xbps_install_time(xbps_dictionary_t xpkg, time_t *out)
 {
+    const char *install_date;
+    const char *repository;
     const char *pkgver;
+    const char *arch;
+    char *buf;
 
-    assert(xpkg != NULL);
+    if (xbps_dictionary_get_cstring_nocopy(xpkg, "install-date", &install_date)) {
+        struct tm t;
+
+        char *next;
+        memset(&t, 0, sizeof(t));
+
+        // Parse timestamp
+        next = strptime(install_date, "%Y-%m-%d %H:%M %Z", &t);
+        if (next == NULL || *next != '\0' || next == install_date) {
+            return -1;
+        }
+
+        *out = mktime(&t);
+        return 0;
+    }
 
     if (!xbps_dictionary_get_cstring_nocopy(xpkg, "pkgver", &pkgver)) {
         return -1;
     }
 
+    if (!xbps_dictionary_get_cstring_nocopy(xpkg, "repository", &repository)) {
+        return -1;
+    }
+
+    if (!xbps_dictionary_get_cstring_nocopy(xpkg, "architecture", &arch)) {
+        return -1;
+    }
+
+    if (asprintf(&buf, "%s/%s.%s.xbps", repository, pkgver, arch) < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(buf, &st) < 0) {
+        free(buf);
+        return -1;
+    }
+
+    *out = st.st_mtime;
+    free(buf);
+    return 0;
+}
+
+int vpkg_gtver(const char *pkgver, time_t install_time, const vpkg::package *vpkg)
+{
     if (vpkg->version.size()) {
         std::string new_version;
         std::string old_version;
         const char *version = xbps_pkg_version(pkgver);
         const char *revision = xbps_pkg_revision(pkgver);
+        std::string_view installed;
 
         if (version == NULL || revision == NULL) {
             return -1;
@@ -64,7 +108,18 @@ int xbps_vpkg_gtver(xbps_dictionary_t xpkg, const vpkg::package *vpkg)
 
         assert(revision >= version);
 
-        old_version = std::string{version, (long unsigned int)(revision - version - 1)};
+        installed = std::string_view{version, (size_t)(revision - version - 1)};
+
+        if (vpkg->vkey.v != NULL) {
+            int32_t buf[VERSION_KEY_MAX];
+            vpkg::version_key key;
+
+            if (vpkg::version_key_init(&key, buf, VERSION_KEY_MAX, installed, false) == 0) {
+                return (vpkg::version_key_cmp(&key, &vpkg->vkey) < 0);
+            }
+        }
+
+        old_version = std::string{installed};
         new_version = std::string{vpkg->version};
 
         std::replace(new_version.begin(), new_version.end(), '-', '.');
@@ -75,54 +130,33 @@ int xbps_vpkg_gtver(xbps_dictionary_t xpkg, const vpkg::package *vpkg)
     }
 
     if (vpkg->last_modified != 0) {
-        const char *install_date;
-        const char *repository;
-        const char *arch;
-        time_t time;
-        char *buf;
-
-
-        if (xbps_dictionary_get_cstring_nocopy(xpkg, "install-date", &install_date)) {
-            struct tm t;
-
-            char *next;
-            memset(&t, 0, sizeof(t));
-
-            // Parse timestamp
-            next = strptime(install_date, "%Y-%m-%d %H:%M %Z", &t);
-            if (next == NULL || *next != '\0' || next == install_date) {
-                return -1;
-            }
-
-            time = mktime(&t);
-        } else {
-            if (!xbps_dictionary_get_cstring_nocopy(xpkg, "repository", &repository)) {
-                return -1;
-            }
+        if (install_time == (time_t)-1) {
+            return -1;
+        }
 
-            if (!xbps_dictionary_get_cstring_nocopy(xpkg, "architecture", &arch)) {
-                return -1;
-            }
+        return (install_time < vpkg->last_modified);
+    }
 
-            if (asprintf(&buf, "%s/%s.%s.xbps", repository, pkgver, arch) < 0) {
-                return -1;
-            }
+    return -1;
+}
 
-            struct stat st;
-            if (stat(buf, &st) < 0) {
-                free(buf);
-                return -1;
-            }
+int xbps_vpkg_gtver(xbps_dictionary_t xpkg, const vpkg::package *vpkg)
+{
+    const char *pkgver;
+    time_t install_time = -1;
 
-            time = st.st_mtime;
-            free(buf);
-        }
+    assert(xpkg != NULL);
 
+    if (!xbps_dictionary_get_cstring_nocopy(xpkg, "pkgver", &pkgver)) {
+        return -1;
+    }
 
-        return (time < vpkg->last_modified);
+    // The install time is only needed for unversioned packages.
+    if (vpkg->version.empty() && vpkg->last_modified != 0 && xbps_install_time(xpkg, &install_time) != 0) {
+        return -1;
     }
 
-    return -1;
+    return vpkg_gtver(pkgver, install_time, vpkg);
 }
 
 void perror_exit(const char *msg)
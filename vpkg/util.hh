@@ -13,6 +13,19 @@ bool is_xdeb(xbps_dictionary_t dict);
 bool yes_no_prompt(void);
 int xbps_vpkg_gtver(xbps_dictionary_t xpkg, const vpkg::package *vpkg);
 
+/*!
+ * Like xbps_vpkg_gtver, for an installed package known by its pkgver and
+ * install time. install_time is only used for unversioned packages and may be
+ * -1 if it is unknown.
+ */
+int vpkg_gtver(const char *pkgver, time_t install_time, const vpkg::package *vpkg);
+
+/*!
+ * Resolve when xpkg was installed, from its install-date or, if it has none,
+ * from the mtime of its binary package.
+ */
+int xbps_install_time(xbps_dictionary_t xpkg, time_t *out);
+
 __attribute__((noreturn))
 void perror_exit(const char *msg);
 
@@ -0,0 +1,155 @@
+#include "vpkg/version.hh"
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <xbps.h>
+
+/*
+ * Mirrors the dewey comparison in libxbps. Do not change these values, they
+ * must order like the modifiers they represent.
+ */
+enum {
+    ALPHA = -3,
+    BETA = -2,
+    RC = -1,
+    DOT = 0,
+};
+
+static const struct {
+    const char *s;
+    size_t len;
+    int32_t t;
+} modifiers[] = {
+    {"alpha", 5, ALPHA},
+    {"beta", 4, BETA},
+    {"pre", 3, RC},
+    {"rc", 2, RC},
+    {"pl", 2, DOT},
+    {".", 1, DOT},
+};
+
+static bool is_separator(char c, bool normalize)
+{
+    return c == '.' || (normalize && (c == '-' || c == '_' || c == '/'));
+}
+
+int vpkg::version_key_init(::vpkg::version_key *key, int32_t *buf, size_t cap, std::string_view version, bool normalize)
+{
+    const char *at = version.data();
+    const char *end = at + version.size();
+    size_t n = 0;
+
+    key->v = buf;
+    key->n = 0;
+    key->revision = 0;
+
+    while (at < end) {
+        // An alphabetic component takes two slots.
+        if (n + 2 > cap) {
+            return -1;
+        }
+
+        if (isdigit((unsigned char)*at)) {
+            uint32_t num = 0;
+
+            for (; at < end && isdigit((unsigned char)*at); at++) {
+                num = num * 10 + (*at - '0');
+            }
+
+            buf[n++] = (int32_t)num;
+            continue;
+        }
+
+        if (is_separator(*at, normalize)) {
+            buf[n++] = DOT;
+            at++;
+            continue;
+        }
+
+        bool matched = false;
+        for (auto &m : modifiers) {
+            if ((size_t)(end - at) >= m.len && strncasecmp(at, m.s, m.len) == 0) {
+                buf[n++] = m.t;
+                at += m.len;
+                matched = true;
+                break;
+            }
+        }
+
+        if (matched) {
+            continue;
+        }
+
+        if (*at == '_') {
+            uint32_t num = 0;
+
+            for (at++; at < end && isdigit((unsigned char)*at); at++) {
+                num = num * 10 + (*at - '0');
+            }
+
+            key->revision = (int32_t)num;
+            continue;
+        }
+
+        if (isalpha((unsigned char)*at)) {
+            buf[n++] = DOT;
+            buf[n++] = tolower((unsigned char)*at) - 'a' + 1;
+        }
+
+        at++;
+    }
+
+    key->n = n;
+    return 0;
+}
+
+/*
+ * xbps compares by the sign of the difference, which overflows for huge
+ * components. Do the same, so both always agree.
+ */
+static int sign_of_difference(int32_t x, int32_t y)
+{
+    int32_t d = (int32_t)((uint32_t)x - (uint32_t)y);
+    return (d > 0) - (d < 0);
+}
+
+int vpkg::version_key_cmp(const ::vpkg::version_key *a, const ::vpkg::version_key *b)
+{
+    uint32_t n = a->n > b->n ? a->n : b->n;
+
+    for (uint32_t i = 0; i < n; i++) {
+        int32_t x = i < a->n ? a->v[i] : 0;
+        int32_t y = i < b->n ? b->v[i] : 0;
+
+        if (x != y) {
+            return sign_of_difference(x, y);
+        }
+    }
+
+    return sign_of_difference(a->revision, b->revision);
+}
+
+int vpkg::version_cmp(std::string_view a, std::string_view b)
+{
+    int32_t abuf[VERSION_KEY_MAX];
+    int32_t bbuf[VERSION_KEY_MAX];
+    vpkg::version_key akey;
+    vpkg::version_key bkey;
+
+    if (version_key_init(&akey, abuf, VERSION_KEY_MAX, a, false) == 0 &&
+        version_key_init(&bkey, bbuf, VERSION_KEY_MAX, b, false) == 0) {
+        return version_key_cmp(&akey, &bkey);
+    }
+
+    // Absurdly long versions, let xbps deal with them.
+    char astr[a.size() + 1];
+    char bstr[b.size() + 1];
+
+    memcpy(astr, a.data(), a.size());
+    astr[a.size()] = '\0';
+    memcpy(bstr, b.data(), b.size());
+    bstr[b.size()] = '\0';
+
+    return xbps_cmpver(astr, bstr);
+}
@@ -0,0 +1,42 @@
+#ifndef VPKG_VERSION_HH_
+#define VPKG_VERSION_HH_
+
+#include <string_view>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace vpkg {
+#define VERSION_KEY_MAX 128
+
+/*!
+ * A version split into the components xbps_cmpver compares. Components past n
+ * compare as zero.
+ */
+struct version_key {
+    const int32_t *v{nullptr};
+    uint32_t n{0};
+    int32_t revision{0};
+};
+
+/*!
+ * Split version into buf, exactly like xbps_cmpver does. If normalize is set,
+ * '-', '_' and '/' are treated as '.', like debian versions are converted.
+ *
+ * @return nonzero if version has more than cap components.
+ */
+int version_key_init(::vpkg::version_key *key, int32_t *buf, size_t cap, std::string_view version, bool normalize);
+
+/*!
+ * @return -1, 0 or 1, with the same result as xbps_cmpver on the source
+ * strings.
+ */
+int version_key_cmp(const ::vpkg::version_key *a, const ::vpkg::version_key *b);
+
+/*!
+ * xbps_cmpver for non-nullterminated strings, without heap allocations.
+ */
+int version_cmp(std::string_view a, std::string_view b);
+}
+
+#endif // VPKG_VERSION_HH_